@@ -0,0 +1,322 @@
+/*
+ * sem_bench.c -- The benchmarks
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * Runs every program of the corpus with every engine and prints the
+ * results as JSON, for example:
+ *
+ *   sem-bench -t 500 gcd loop > before.json
+ *
+ * Each program runs in a child process, so that the peak memory is
+ * its own, with the output discarded and the input read from a
+ * temporary file. The number of dispatched opcodes is counted once
+ * by stepping the program; then it runs until at least min time has
+ * passed, and the best run is reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "sem.h"
+#include "config.h"
+
+#ifndef SEM_SOURCE_DIR
+#define SEM_SOURCE_DIR "."
+#endif
+
+struct benchmark {
+	const char *name;
+	const char *file;	/* relative to the source directory */
+	const char *input;
+	size_t memsize;
+};
+
+static const struct benchmark corpus[] = {
+	{"fact", "examples/fact.sem", "12\n", 64},
+	{"rfact", "examples/rfact.sem", "12\n", 64},
+	{"gcd", "examples/gcd.sem", "1000000\n1\n", 64},
+	{"pow", "examples/pow.sem", "1\n1000000\n", 64},
+	{"loop", "bench/loop.sem", "", 64},
+	{"sieve", "bench/sieve.sem", "", 1024},
+	{"collatz", "bench/collatz.sem", "", 64},
+};
+
+struct engine {
+	const char *name;
+	int optimize;
+	int (*eval)(struct vm *, struct code *);
+};
+
+static const struct engine engines[] = {
+	{"interpreter", 0, eval_code},
+	{"optimized", 1, eval_code},
+	{"jit", 1, eval_code_jit},
+};
+
+constexpr size_t STACK_SIZE = 64;
+
+/* What a child reports back. */
+struct result {
+	int status;	/* 0, or the status of the failed run */
+	uint64_t compile_ns;
+	uint64_t opcodes;
+	uint64_t runs;
+	uint64_t best_ns;
+	uint64_t total_ns;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Count the opcodes dispatched by a whole run. */
+static uint64_t count_opcodes(struct code *code, size_t memsize)
+{
+	struct vm *vm = vm_init(memsize, STACK_SIZE, 0);
+	uint64_t n = 0;
+	int sts = 0;
+
+	rewind(stdin);
+	while (sts == 0) {
+		sts = eval_code_one_step(vm, code);
+		n++;
+	}
+	vm_destroy(vm);
+	return n;
+}
+
+static void measure(const struct benchmark *b, const struct engine *e, const char *dir,
+		    uint64_t min_ns, struct result *r)
+{
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", dir, b->file);
+
+	/* Compiling is fast: take the best of a few. */
+	struct code *code = NULL;
+	r->compile_ns = UINT64_MAX;
+	for (int i = 0; i < 5; i++) {
+		const uint64_t start = now_ns();
+		struct code *c = compile_code(path, e->optimize);
+		const uint64_t elapsed = now_ns() - start;
+		if (c == NULL) {
+			r->status = -1;
+			return;
+		}
+		if (elapsed < r->compile_ns) {
+			r->compile_ns = elapsed;
+		}
+		if (code != NULL) {
+			code_destroy(code);
+		}
+		code = c;
+	}
+
+	r->opcodes = count_opcodes(code, b->memsize);
+	r->best_ns = UINT64_MAX;
+	while (r->runs < 3 || r->total_ns < min_ns) {
+		struct vm *vm = vm_init(b->memsize, STACK_SIZE, 0);
+		rewind(stdin);
+		const uint64_t start = now_ns();
+		const int sts = e->eval(vm, code);
+		fflush(stdout);
+		const uint64_t elapsed = now_ns() - start;
+		vm_destroy(vm);
+
+		if (sts < 0) {
+			r->status = sts;
+			break;
+		}
+		r->runs++;
+		r->total_ns += elapsed;
+		if (elapsed < r->best_ns) {
+			r->best_ns = elapsed;
+		}
+	}
+	code_destroy(code);
+}
+
+/*
+ * Run a benchmark in a child, with stdin reading the input from a
+ * temporary file and stdout and stderr discarded. Returns -1 if the
+ * child failed.
+ */
+static int run_child(const struct benchmark *b, const struct engine *e, const char *dir,
+		     uint64_t min_ns, struct result *r, long *peak_kb)
+{
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("sem-bench: pipe");
+		return -1;
+	}
+	fflush(stdout);
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		perror("sem-bench: fork");
+		return -1;
+	}
+
+	if (pid == 0) {
+		struct result res = { 0 };
+		FILE *in = tmpfile();
+		const int null = open("/dev/null", O_WRONLY);
+		if (in == NULL || null < 0) {
+			_exit(EXIT_FAILURE);
+		}
+		fputs(b->input, in);
+		fflush(in);
+		dup2(fileno(in), STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		close(fds[0]);
+
+		measure(b, e, dir, min_ns, &res);
+		const ssize_t n = write(fds[1], &res, sizeof(res));
+		_exit(n == (ssize_t)sizeof(res) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	close(fds[1]);
+	const ssize_t n = read(fds[0], r, sizeof(*r));
+	close(fds[0]);
+
+	int wstatus;
+	struct rusage usage;
+	if (wait4(pid, &wstatus, 0, &usage) < 0 || n != (ssize_t)sizeof(*r)
+	    || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+		return -1;
+	}
+	*peak_kb = usage.ru_maxrss;
+	return 0;
+}
+
+static void print_result(const struct benchmark *b, const struct engine *e,
+			 const struct result *r, long peak_kb, int first)
+{
+	printf("%s\n    {\"benchmark\": \"%s\", \"file\": \"%s\", \"engine\": \"%s\", ",
+	       first ? "" : ",", b->name, b->file, e->name);
+
+	if (r->status != 0 || r->runs == 0) {
+		printf("\"status\": \"error\"}");
+		return;
+	}
+
+	const double best = (double)r->best_ns;
+	printf("\"status\": \"ok\", \"compile_ns\": %llu, \"opcodes\": %llu, "
+	       "\"runs\": %llu, \"best_ns\": %llu, \"mean_ns\": %llu, "
+	       "\"ns_per_dispatch\": %.3f, \"instructions_per_sec\": %.0f, "
+	       "\"peak_rss_kb\": %ld}",
+	       (unsigned long long)r->compile_ns, (unsigned long long)r->opcodes,
+	       (unsigned long long)r->runs, (unsigned long long)r->best_ns,
+	       (unsigned long long)(r->total_ns / r->runs),
+	       best / (double)r->opcodes, (double)r->opcodes * 1e9 / best, peak_kb);
+}
+
+static int selected(const char *name, int argc, char *argv[])
+{
+	if (optind >= argc) {
+		return 1;
+	}
+	for (int i = optind; i < argc; i++) {
+		if (strcmp(argv[i], name) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void usage(int sts)
+{
+	fprintf(sts == EXIT_SUCCESS ? stdout : stderr, "\
+Usage: sem-bench [options] [benchmark...]\n\
+\n\
+Options:\n\
+  -d : the source directory, holding examples/ and bench/ (the default is %s)\n\
+  -e : run only this engine (interpreter, optimized or jit)\n\
+  -h : print this help message and exit\n\
+  -t : run each benchmark for at least this many milliseconds (the default is 200)\n", SEM_SOURCE_DIR);
+	exit(sts);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = SEM_SOURCE_DIR;
+	const char *only = NULL;
+	long min_ms = 200;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:e:ht:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'e':
+			only = optarg;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		case 't':
+			min_ms = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	printf("{\n  \"version\": \"%s\",\n  \"min_time_ms\": %ld,\n  \"results\": [", PACKAGE_VERSION, min_ms);
+
+	int first = 1;
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		const struct benchmark *b = &corpus[i];
+		if (!selected(b->name, argc, argv)) {
+			continue;
+		}
+		for (size_t j = 0; j < sizeof(engines) / sizeof(engines[0]); j++) {
+			const struct engine *e = &engines[j];
+			if (only != NULL && strcmp(only, e->name) != 0) {
+				continue;
+			}
+
+			struct result r = { 0 };
+			long peak_kb = 0;
+			if (run_child(b, e, dir, (uint64_t)min_ms * 1000000u, &r, &peak_kb) < 0) {
+				r.status = -1;
+			}
+			failed |= r.status != 0;
+			print_result(b, e, &r, peak_kb, first);
+			first = 0;
+		}
+	}
+
+	printf("\n  ]\n}\n");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
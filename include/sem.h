@@ -21,70 +21,310 @@
 
 #pragma once
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 // memory.c
 extern void *xmalloc(size_t);
 
+extern void *xrealloc(void *, size_t);
+
 extern char *xstrdup(const char *);
 
 extern char *unquote(const char *str, char *dest, size_t dest_size);
 
 extern char *quote(const char *str, char *dest, size_t dest_size);
 
+/*
+ * An arena: memory handed out by bumping a pointer through chunks
+ * from xmalloc(), and released all at once by arena_destroy().
+ */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size; /* bytes in data */
+	size_t used;
+	alignas(max_align_t) unsigned char data[];
+};
+
+struct arena {
+	struct arena_chunk *chunks; /* the current chunk first */
+};
+
+extern void arena_init(struct arena *a);
+
+extern void *arena_alloc(struct arena *a, size_t size);
+
+extern char *arena_strdup(struct arena *a, const char *str);
+
+extern void arena_destroy(struct arena *a);
+
+/* FNV-1a: hash n bytes at p, continuing from h (FNV1A_SEED to start). */
+#define FNV1A_SEED UINT64_C(0xcbf29ce484222325)
+
+extern uint64_t fnv1a(uint64_t h, const void *p, size_t n);
+
 // io.c
 extern int ask(const char *question, char *answer, int answer_size);
 
 extern int ask_yes_no(const char *question);
 
-extern int fetch_line_from_file(const char *filename, int lineno, char *dest, int dest_size);
+/*
+ * A source file, mapped once, with where each line starts: line n
+ * (from 1) is the text from lines[n - 1] up to lines[n], its newline
+ * excluded.
+ */
+struct source {
+	const char *text;
+	size_t size;
+	size_t *lines;
+	int nlines;
+};
+
+extern int source_open(struct source *s, const char *filename);
+
+extern const char *source_line(const struct source *s, int lineno, int *len);
+
+extern void source_close(struct source *s);
+
+/*
+ * The output of a program, written with write(2) when the buffer is
+ * full or flushed, or after every write if unbuffered.
+ */
+enum { WRITER_SIZE = 64 * 1024 };
+
+struct writer {
+	int fd;
+	int unbuffered;
+	size_t len; /* bytes in buf */
+	char buf[WRITER_SIZE];
+};
+
+extern void writer_init(struct writer *w, int fd);
+
+extern void writer_flush(struct writer *w);
+
+extern void writer_int(struct writer *w, int v);
+
+extern void writer_str(struct writer *w, const char *s, size_t len);
+
+extern void writer_char(struct writer *w, char c);
+
+/*
+ * The input of a program: whitespace separated integers, read from a
+ * mapping of fd if it is a regular file, else in blocks. If fp is set,
+ * it is read a line at a time instead, as the debugger reads its
+ * commands from the same stream.
+ */
+enum { READER_SIZE = 64 * 1024 };
+
+struct reader {
+	int fd;
+	FILE *fp;
+	char *buf;
+	size_t pos; /* next byte in buf */
+	size_t len; /* bytes in buf */
+	size_t capacity; /* bytes allocated for buf */
+	size_t mapped; /* bytes mapped, if buf is the mapping of fd */
+	int eof;
+	const char *token; /* the last integer read */
+	size_t toklen;
+	char bad; /* where it is invalid */
+};
+
+enum read_status {
+	READ_OK,
+	READ_EOF,
+	READ_RANGE, /* out of the range of long */
+	READ_INVALID,
+};
+
+extern void reader_init(struct reader *r, int fd);
+
+extern void reader_destroy(struct reader *r);
+
+extern enum read_status reader_int(struct reader *r, int *v);
+
+/*
+ * Opcodes, with the number of values each one pops from and pushes
+ * onto the evaluation stack.
+ *
+ * SETLINENO marks the start of a line for the optimizer, and it is
+ * removed before the code runs.
+ *
+ * The second group are superinstructions, emitted by the peephole
+ * optimizer in place of common sequences; their integer argument is
+ * the constant operand (an address, a value or a line). The compiler
+ * resolves the line of GOTO and of the compare-and-branch opcodes to
+ * the index of its first opcode, so they jump without any check.
+ *
+ * MEMU and SETU are MEM and SET whose address is proven to be between
+ * 0 and their argument (see bound_addresses()): an engine whose memory
+ * is larger than that does not check it.
+ *
+ * LOOP starts a line heading a loop recognised by fuse_loops(); its
+ * argument is the index of the loop in code->loops.
+ */
+#define OPCODES(X)				\
+	X(SETLINENO,	0, 0)			\
+	X(SET,		2, 0)			\
+	X(JUMP,		1, 0)			\
+	X(JUMPT,	2, 0)			\
+	X(INT,		0, 1)			\
+	X(READ,		1, 0)			\
+	X(WRITE_INT,	1, 0)			\
+	X(WRITE_STR,	0, 0)			\
+	X(WRITELN_INT,	1, 0)			\
+	X(WRITELN_STR,	0, 0)			\
+	X(MEM,		1, 1)			\
+	X(ADD,		2, 1)			\
+	X(SUB,		2, 1)			\
+	X(MUL,		2, 1)			\
+	X(DIV,		2, 1)			\
+	X(MOD,		2, 1)			\
+	X(EQ,		2, 1)			\
+	X(NE,		2, 1)			\
+	X(GT,		2, 1)			\
+	X(LT,		2, 1)			\
+	X(GE,		2, 1)			\
+	X(LE,		2, 1)			\
+	X(IP,		0, 1)			\
+	X(HALT,		0, 0)			\
+	/* D[k] */				\
+	X(LOAD,		0, 1)			\
+	/* set k, expr */			\
+	X(STORE,	1, 0)			\
+	/* expr op k */				\
+	X(ADDI,		1, 1)			\
+	X(SUBI,		1, 1)			\
+	X(MULI,		1, 1)			\
+	X(DIVI,		1, 1)			\
+	X(MODI,		1, 1)			\
+	X(EQI,		1, 1)			\
+	X(NEI,		1, 1)			\
+	X(GTI,		1, 1)			\
+	X(LTI,		1, 1)			\
+	X(GEI,		1, 1)			\
+	X(LEI,		1, 1)			\
+	/* jump k */				\
+	X(GOTO,		0, 0)			\
+	/* jumpt k, expr op expr */		\
+	X(JEQ,		2, 0)			\
+	X(JNE,		2, 0)			\
+	X(JGT,		2, 0)			\
+	X(JLT,		2, 0)			\
+	X(JGE,		2, 0)			\
+	X(JLE,		2, 0)			\
+	/* D[p] and set p, expr, with 0 <= p <= k */	\
+	X(MEMU,		1, 1)			\
+	X(SETU,		2, 0)			\
+	/* the loop k at once, or its opcodes */	\
+	X(LOOP,		0, 0)
 
-/* Opcodes. */
 typedef enum {
-	SETLINENO,
-	SET,
-	JUMP,
-	JUMPT,
-	INT,
-	READ,
-	WRITE_INT,
-	WRITE_STR,
-	WRITELN_INT,
-	WRITELN_STR,
-	MEM,
-	ADD,
-	SUB,
-	MUL,
-	DIV,
-	MOD,
-	EQ,
-	NE,
-	GT,
-	LT,
-	GE,
-	LE,
-	IP,
-	HALT
+#define X(op, pops, pushes) op,
+	OPCODES(X)
+#undef X
 } opcode_t;
 
+enum {
+#define X(op, pops, pushes) + 1
+	NOPCODES = 0 OPCODES(X)
+#undef X
+};
+
+extern const signed char opcode_pops[];
+
+extern const signed char opcode_pushes[];
+
 struct instr {
 	opcode_t opcode; /* opcode */
-	int intv; /* integer argument */
-	char *strv; /* string argument */
-	struct instr *next; /* next opcode */
+	int intv; /* integer argument, or offset in the string pool */
+};
+
+/*
+ * A counted loop, that LOOP runs at once (see loops.c). From i = D[var],
+ * going up by one while i rel bound, it does one of:
+ *
+ *   LOOP_FILL       set D[var] + dst, value
+ *   LOOP_COPY       set D[var] + dst, D[D[var] + src]
+ *   LOOP_SUM        set sum, D[sum] + D[D[var] + src]
+ *   LOOP_FIND       jumpt found, D[D[var] + src] = value
+ *   LOOP_FIND_NOT   jumpt found, D[D[var] + src] != value
+ *
+ * testing rel before the body (while) or after it (do ... while).
+ */
+enum loop_kind { LOOP_FILL, LOOP_COPY, LOOP_SUM, LOOP_FIND, LOOP_FIND_NOT, NLOOP_KINDS };
+
+struct loop_operand {
+	int k;
+	int cell; /* the operand is D[k], not k */
+};
+
+struct loop {
+	int kind;
+	int tested_first; /* while, rather than do ... while */
+	int var; /* the address of i */
+	int rel; /* LT, LE or NE */
+	struct loop_operand bound;
+	struct loop_operand value;
+	int dst;
+	int src;
+	int sum;
+	int head; /* the line of LOOP */
+	int exit; /* the line after the loop */
+	int found; /* the line jumped to by find */
+	int len; /* opcodes of the loop, LOOP included */
+	int at; /* of the branch of find, from LOOP */
 };
 
+/*
+ * The compiled code. The engines only read it, so threads can share
+ * it, each running its own vm.
+ */
 struct code {
-	struct instr *head; /* the head */
-	struct instr *code; /* the code as linked list; it grows as compiler emits opcodes */
+	struct instr *instrs; /* the code as a flat array; it grows as compiler emits opcodes */
+	size_t ninstrs; /* number of emitted opcodes */
+	size_t capacity; /* number of allocated opcodes */
+	char *strings; /* string pool, holding the string arguments, each after its length */
+	size_t strings_size; /* bytes used in the string pool */
+	size_t strings_capacity; /* bytes allocated for the string pool */
 	size_t size; /* the code size as number of lines */
-	struct instr **jumps; /* jump table */
+	size_t *jumps; /* where each line starts, as indices into instrs */
+	struct loop *loops; /* of the LOOP opcodes */
+	size_t nloops;
 	char *filename;
+	struct arena arena; /* holding jumps, loops, filename and interned */
+	int *interned; /* offsets of the strings in the pool, by hash; 0 is empty */
+	size_t interned_capacity;
+	size_t ninterned;
+	size_t depth; /* the stack needed by the deepest line, in values */
+	int depth_line; /* that line */
+	int optimized; /* compiled with constant folding */
+	void *map; /* if loaded from a bytecode file, its mapping, holding instrs, jumps, loops and strings */
+	size_t mapsize;
+	uint64_t id; /* given by code_new_id(), unlike any other code of the process */
 };
 
+/* Return the string argument of a WRITE_STR or WRITELN_STR opcode. */
+static inline const char *code_string(const struct code *code, const struct instr *i)
+{
+	return code->strings + i->intv;
+}
+
+/* Return the length of a string in the string pool, stored before it. */
+static inline size_t code_strlen(const char *s)
+{
+	uint32_t len;
+	memcpy(&len, s - sizeof(len), sizeof(len));
+	return len;
+}
+
 /* The interpreter. */
 struct vm {
-	/* The Instruction Pointer. */
-	struct instr *ip;
-	int lineno;
+	/* The Instruction Pointer, as an index into code->instrs. */
+	size_t ip;
 
 	/*
 	 * The data memory
@@ -92,32 +332,324 @@ struct vm {
 	 *
 	 * This is the data memory (D). Data memory's addresses start
 	 * at 0 and, it can be used /only/ to store/retrieve integers.
+	 *
+	 * A large memory is mapped, so that pages are allocated when
+	 * first touched; a sparse memory is instead a two-level table
+	 * of pages, allocated when first written, and mem is NULL. Use
+	 * vm_load() and vm_store() to access either.
 	 */
 	int *mem;
 	size_t memsize;
+	size_t mapsize; /* bytes mapped for mem, or 0 */
+	int ***pages; /* a sparse memory, as tables of pages, NULL until written */
+	int image; /* while mem is shared with forks, the file they map; -1 if not, -2 if it cannot be */
+	int cow; /* mem is a private mapping of a fork's image */
 
 	/*
 	 * The evaluation stack
 	 * ====================
 	 *
 	 * The stack is a fixed size, which means there's a limit on
-	 * the nesting allowed in expressions.
+	 * the nesting allowed in expressions. It is empty between lines,
+	 * so the compiler knows how deep each line goes (code->depth):
+	 * the engines check that once, then push without checking.
 	 */
 	int *stack;
 	size_t stacksize;
 	int *stacktop;
+
+	/* The input of read, the output of write and writeln, and the errors. */
+	struct reader in;
+	struct writer out;
+	FILE *err;
+
+	/*
+	 * The threaded code of the program a threaded engine ran last,
+	 * which the same engine runs again for the same program rather
+	 * than threading it on every call, as the scheduler and the
+	 * debugger make them. It is kept by the id of the program, not its
+	 * address, which a program compiled after it was freed may reuse.
+	 */
+	void *thread;
+	uint64_t thread_code; /* the id of the program, 0 if none */
+	const void *thread_engine; /* the handlers it was threaded with */
 };
 
-extern struct code *compile_code(const char *filename);
+extern struct code *compile_code(const char *filename, int optimize);
+
+extern struct code *compile_source(const char *source, const char *name);
 
 extern void code_destroy(struct code *code);
 
-extern struct vm *vm_init(size_t mem_size, size_t stack_size);
+extern uint64_t code_new_id(void);
+
+extern int code_lineno(const struct code *code, size_t pc);
+
+/* vm_init() flags. */
+enum {
+	VM_SPARSE = 1, /* a sparse memory */
+	VM_HUGE_PAGES = 2, /* map the memory on huge pages, where supported */
+};
+
+/* A sparse memory's pages, and tables of pages. */
+enum {
+	VM_PAGE_CELLS = 1024,
+	VM_TABLE_PAGES = 1024,
+};
+
+extern struct vm *vm_init(size_t mem_size, size_t stack_size, unsigned int flags);
+
+extern int *vm_page(struct vm *vm, size_t n);
+
+/* D[p], for p < vm->memsize. */
+static inline int vm_load(const struct vm *vm, size_t p)
+{
+	if (vm->mem != NULL) {
+		return vm->mem[p];
+	}
+	const size_t n = p / VM_PAGE_CELLS;
+	int *const *table = vm->pages[n / VM_TABLE_PAGES];
+	const int *page = (table != NULL) ? table[n % VM_TABLE_PAGES] : NULL;
+	return (page != NULL) ? page[p % VM_PAGE_CELLS] : 0;
+}
+
+/* Set D[p], for p < vm->memsize. Storing 0 into a missing page is a no-op. */
+static inline void vm_store(struct vm *vm, size_t p, int v)
+{
+	if (vm->mem != NULL) {
+		vm->mem[p] = v;
+	} else if (v != 0 || vm_load(vm, p) != 0) {
+		vm_page(vm, p / VM_PAGE_CELLS)[p % VM_PAGE_CELLS] = v;
+	}
+}
 
 extern void vm_destroy(struct vm *vm);
 
+extern void vm_reset(struct vm *vm);
+
+extern const int *vm_cells(const struct vm *vm, size_t n, size_t *ncells);
+
+extern int vm_check_stack(const struct code *code, size_t stacksize);
+
 extern int eval_code(struct vm *vm, struct code *code);
 
+extern int eval_code_resume(struct vm *vm, struct code *code);
+
 extern int eval_code_one_step(struct vm *vm, struct code *code);
 
+/*
+ * Breakpoints and watchpoints, for eval_code_until().
+ *
+ * A line has a breakpoint if its bit is set in lines[] (code->size / 64
+ * + 1 words); stop decides whether to stop there (always, if NULL).
+ *
+ * A cell is watched if its bit is set in writes[], or reads[] too if
+ * reading it stops as well; both hold watch_limit bits, and no cell
+ * is watched if watch_limit is 0. After stopping at an access, line,
+ * addr, before, after and written tell where it was, which cell, its
+ * value before and after it, and whether it was a write.
+ */
+struct breakpoints {
+	uint64_t *lines;
+	int (*stop)(void *arg, int line);
+	void *arg;
+	uint64_t *writes;
+	uint64_t *reads;
+	size_t watch_limit;
+	int line, addr, before, after, written;
+	int stopped; /* what eval_code_until() last returned */
+	struct history *history; /* if recording, see history.c */
+};
+
+/* What eval_code_until() and eval_code_fuel() return, besides what eval_code_one_step() does. */
+enum {
+	VM_BREAK = 2, /* at a breakpoint */
+	VM_WATCH = 3, /* after an access to a watched cell */
+	VM_YIELD = 4, /* out of fuel */
+};
+
+static inline int has_breakpoint(const struct breakpoints *bp, int line)
+{
+	return (int)((bp->lines[line / 64] >> (line % 64)) & 1);
+}
+
+static inline int is_watched(const uint64_t *bits, const struct breakpoints *bp, int p)
+{
+	return (size_t)p < bp->watch_limit && ((bits[p / 64] >> (p % 64)) & 1);
+}
+
+extern int eval_code_until(struct vm *vm, struct code *code, struct breakpoints *bp);
+
+extern int vm_access(const struct vm *vm, const struct code *code, int *writes);
+
+extern int eval_code_fuel(struct vm *vm, struct code *code, int64_t *fuel);
+
+[[gnu::format(printf, 4, 5)]]
+extern void vm_error(struct vm *vm, int lineno, int *sp, const char *fmt, ...);
+
+extern int vm_read(struct vm *vm, int lineno, int *sp, int addr);
+
 extern int debug_code(struct vm *vm, struct code *code);
+
+/*
+ * The profiler
+ * ============
+ *
+ * Counts filled by eval_code_profile(), a separate engine, so that the
+ * others pay nothing for it.
+ */
+struct profile {
+	uint64_t *hits; /* executions of each opcode, by index in code->instrs */
+	int *line_at; /* the line starting at each opcode, or 0 */
+	uint64_t *ticks; /* time spent in each line, by line number, if timed */
+	uint64_t opcodes[NOPCODES]; /* executions of each opcode */
+	uint64_t pairs[NOPCODES][NOPCODES]; /* executions of an opcode (2nd) after another */
+	int timed;
+};
+
+extern int eval_code_profile(struct vm *vm, struct code *code, struct profile *prof);
+
+// profile.c
+extern struct profile *profile_init(const struct code *code, int timed);
+
+extern void profile_destroy(struct profile *prof);
+
+extern void profile_report(FILE *out, const struct code *code, const struct profile *prof);
+
+extern int profile_write_collapsed(const char *filename, const struct code *code, const struct profile *prof);
+
+// batch.c
+struct batch {
+	const char *dir; /* the inputs */
+	unsigned int jobs; /* worker threads */
+	int jit;
+	size_t memsize;
+	size_t stacksize;
+	unsigned int memory_flags;
+	struct vm *start; /* if not NULL, every job runs on from a fork of it */
+	uint64_t quantum; /* if not 0, the jobs take turns on the scheduler */
+	uint64_t fuel_limit; /* of each job, or 0 */
+	uint64_t cpu_limit; /* of each job, in nanoseconds, or 0 */
+};
+
+extern int run_batch(const struct code *code, const struct batch *b);
+
+// sched.c
+struct task {
+	struct vm *vm;
+	struct code *code;
+	uint64_t fuel_limit; /* opcodes, about, or 0 for none */
+	uint64_t cpu_limit; /* nanoseconds of CPU, or 0 for none */
+	int (*start)(struct task *t); /* if not NULL, run before the first slice; < 0 fails the task */
+	void (*finish)(struct task *t); /* if not NULL, run once the task is done */
+	void *arg;
+
+	/* Kept by the scheduler. */
+	uint64_t fuel_used;
+	uint64_t cpu_used; /* nanoseconds */
+	uint64_t slices;
+	int status; /* once done: 0 if it halted, < 0 after an error or over a limit */
+	struct task *next;
+};
+
+struct scheduler;
+
+extern struct scheduler *sched_init(unsigned int workers, uint64_t quantum, size_t max_active);
+
+extern void sched_submit(struct scheduler *s, struct task *t);
+
+extern void sched_destroy(struct scheduler *s);
+
+// history.c
+struct history_step {
+	uint32_t ip; /* the opcode */
+	uint32_t next; /* the opcode after it */
+	uint32_t depth; /* of the stack, before it */
+	int popped[2]; /* from the top */
+	int pushed;
+	int addr; /* the cell written, or -1 */
+	int before, after; /* its value */
+};
+
+struct checkpoint {
+	uint64_t step; /* UINT64_MAX if none */
+	int *mem;
+	int *stack;
+	size_t depth;
+	size_t ip;
+};
+
+/*
+ * Steps first to end - 1 are recorded, and the vm is at step now: the
+ * state after step now - 1.
+ */
+struct history {
+	struct history_step *steps; /* a ring of capacity steps */
+	size_t capacity;
+	uint64_t first, now, end;
+	struct checkpoint *checkpoints; /* a ring, a checkpoint every so many steps */
+	size_t ncheckpoints;
+	uint64_t every;
+};
+
+extern struct history *history_init(const struct vm *vm, size_t steps);
+
+extern void history_destroy(struct history *h);
+
+extern void history_clear(struct history *h);
+
+extern size_t history_size(const struct history *h, const struct vm *vm);
+
+extern int history_forward(struct history *h, struct vm *vm, struct code *code);
+
+extern const struct history_step *history_back(struct history *h, struct vm *vm, const struct code *code);
+
+extern int history_seek(struct history *h, struct vm *vm, struct code *code, uint64_t step);
+
+// snapshot.c
+extern uint64_t code_hash(const struct code *code);
+
+extern int vm_snapshot(const struct vm *vm, const struct code *code, const char *filename);
+
+extern struct vm *vm_restore(const struct code *code, const char *filename, size_t stacksize, unsigned int flags);
+
+extern int vm_share(struct vm *vm);
+
+extern struct vm *vm_fork(struct vm *vm);
+
+extern void vm_unshare(struct vm *vm);
+
+// cache.c
+extern int source_hash(const char *filename, uint64_t *hash);
+
+extern int code_save(const struct code *code, const char *filename);
+
+extern struct code *code_load(const char *filename);
+
+extern struct code *compile_cached(const char *filename, int optimize);
+
+// emit.c
+extern int emit_c(FILE *out, const struct code *code, size_t memsize);
+
+extern int emit_native(const struct code *code, size_t memsize, const char *output);
+
+// jit.c
+extern int eval_code_jit(struct vm *vm, struct code *code);
+
+// optimize.c
+extern void fold_constants(struct code *code);
+
+extern int is_branch(opcode_t op);
+
+extern void peephole(struct code *code);
+
+extern void bound_addresses(struct code *code);
+
+extern int stack_depth(struct code *code);
+
+// loops.c
+extern void fuse_loops(struct code *code);
+
+extern int valid_loop(const struct code *code, const struct loop *l);
+
+extern int loop_run(struct vm *vm, const struct code *code, int k, int64_t *fuel);
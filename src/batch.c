@@ -0,0 +1,401 @@
+/*
+ * batch.c -- The batch runner
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * Runs one program over every file of a directory, each file being
+ * the input of a job:
+ *
+ *   sem --batch inputs/ --jobs 8 prog.sem
+ *
+ * Workers share the code and each runs its own vm, reset between jobs;
+ * or, when resuming a snapshot (--resume), a fork of the restored vm,
+ * whose memory the jobs share until they write it.
+ * Jobs are dealt to the workers' queues in turn; a worker takes from
+ * the front of its own queue and, when it is empty, steals from the
+ * back of the others'. The output and the errors of a job go to
+ * temporary files, copied to stdout and stderr in the order of the
+ * jobs as soon as each is done.
+ *
+ * With a quantum, the jobs run on the scheduler instead (see sched.c),
+ * taking turns, each in a vm of its own, and within their limits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sem.h"
+
+/* Jobs started at once on the scheduler, for every worker: each holds three files. */
+constexpr size_t ACTIVE_JOBS = 16;
+
+struct job {
+	char *path;
+	const char *name;
+	FILE *out;
+	FILE *err;
+	int fd; /* the input, while it runs */
+	int status; /* of the run: 0, or < 0 on error */
+	int done;
+	struct pool *pool;
+	struct task task; /* on the scheduler */
+};
+
+/* The jobs of a worker, by index, from head to tail. */
+struct queue {
+	pthread_mutex_t lock;
+	size_t *jobs;
+	size_t head;
+	size_t tail;
+};
+
+struct pool {
+	const struct code *code;
+	const struct batch *batch;
+	struct job *jobs;
+	size_t njobs;
+	struct queue *queues;
+	unsigned int nworkers;
+	pthread_mutex_t lock; /* for done */
+	pthread_cond_t done;
+};
+
+struct worker {
+	struct pool *pool;
+	unsigned int id;
+	pthread_t thread;
+};
+
+/* The next job of worker id: its own first, then the last of another. */
+static int take(struct pool *pool, unsigned int id, size_t *job)
+{
+	struct queue *q = &pool->queues[id];
+	pthread_mutex_lock(&q->lock);
+	const int found = q->head < q->tail;
+	if (found) {
+		*job = q->jobs[q->head++];
+	}
+	pthread_mutex_unlock(&q->lock);
+	if (found) {
+		return 1;
+	}
+
+	for (unsigned int i = 1; i < pool->nworkers; i++) {
+		struct queue *victim = &pool->queues[(id + i) % pool->nworkers];
+		pthread_mutex_lock(&victim->lock);
+		const int stolen = victim->head < victim->tail;
+		if (stolen) {
+			*job = victim->jobs[--victim->tail];
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if (stolen) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Open the files of a job, and point the streams of its vm to them. Returns -1 if it cannot. */
+static int job_open(struct job *job, struct vm *vm)
+{
+	job->out = tmpfile();
+	job->err = tmpfile();
+	if (job->out == NULL || job->err == NULL) {
+		fprintf(stderr, "sem: cannot create a temporary file\n");
+		job->status = -1;
+		return -1;
+	}
+
+	job->fd = open(job->path, O_RDONLY);
+	if (job->fd < 0) {
+		fprintf(job->err, "sem: cannot open '%s'\n", job->path);
+		job->status = -1;
+		return -1;
+	}
+
+	reader_init(&vm->in, job->fd);
+	writer_init(&vm->out, fileno(job->out));
+	vm->err = job->err;
+	return 0;
+}
+
+static void job_close(struct job *job, struct vm *vm)
+{
+	writer_flush(&vm->out);
+	fflush(job->err);
+	reader_destroy(&vm->in);
+	reader_init(&vm->in, -1);
+	close(job->fd);
+}
+
+static void job_done(struct pool *pool, struct job *job)
+{
+	pthread_mutex_lock(&pool->lock);
+	job->done = 1;
+	pthread_cond_broadcast(&pool->done);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void run_job(struct pool *pool, struct vm *vm, struct job *job)
+{
+	const struct batch *b = pool->batch;
+	if (b->start != NULL) {
+		vm = vm_fork(b->start);
+	} else {
+		vm_reset(vm);
+	}
+
+	if (job_open(job, vm) == 0) {
+		struct code *code = (struct code *)pool->code;
+		if (b->start != NULL) {
+			job->status = eval_code_resume(vm, code);
+		} else {
+			job->status = b->jit ? eval_code_jit(vm, code) : eval_code(vm, code);
+		}
+		job_close(job, vm);
+	}
+
+	if (b->start != NULL) {
+		vm->err = stderr;
+		vm_destroy(vm);
+	}
+}
+
+/* A job on the scheduler makes its vm when it starts, and frees it once done. */
+static int task_start(struct task *t)
+{
+	struct job *job = t->arg;
+	const struct batch *b = job->pool->batch;
+	t->vm = (b->start != NULL) ? vm_fork(b->start) : vm_init(b->memsize, b->stacksize, b->memory_flags);
+	return job_open(job, t->vm);
+}
+
+static void task_finish(struct task *t)
+{
+	struct job *job = t->arg;
+	if (job->fd >= 0) {
+		job_close(job, t->vm);
+		job->status = t->status;
+	}
+	if (t->vm != NULL) {
+		t->vm->err = stderr;
+		vm_destroy(t->vm);
+		t->vm = NULL;
+	}
+	job_done(job->pool, job);
+}
+
+static void *work(void *arg)
+{
+	struct worker *w = arg;
+	struct pool *pool = w->pool;
+	const struct batch *b = pool->batch;
+	struct vm *vm = vm_init(b->memsize, b->stacksize, b->memory_flags);
+	size_t i;
+
+	while (take(pool, w->id, &i)) {
+		run_job(pool, vm, &pool->jobs[i]);
+		job_done(pool, &pool->jobs[i]);
+	}
+
+	vm->err = stderr;
+	vm_destroy(vm);
+	return NULL;
+}
+
+/* Copy a temporary file to out, then close it. */
+static void copy(FILE *tmp, FILE *out)
+{
+	char buf[64 * 1024];
+	size_t n;
+
+	if (tmp == NULL) {
+		return;
+	}
+	rewind(tmp);
+	while ((n = fread(buf, 1, sizeof(buf), tmp)) > 0) {
+		fwrite(buf, 1, n, out);
+	}
+	fclose(tmp);
+}
+
+static int visible(const struct dirent *e)
+{
+	return e->d_name[0] != '.';
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run the code over every file in b->dir, in the order of their names,
+ * then print a summary to stderr. Returns 0 if every job succeeded.
+ */
+int run_batch(const struct code *code, const struct batch *b)
+{
+	struct dirent **entries;
+	const int n = scandir(b->dir, &entries, visible, alphasort);
+	if (n < 0) {
+		fprintf(stderr, "sem: cannot read directory '%s'\n", b->dir);
+		return -1;
+	}
+	if (b->start != NULL) {
+		/* Then the workers fork it at once; failing, they copy it. */
+		vm_share(b->start);
+	}
+
+	struct pool pool = {
+		.code = code,
+		.batch = b,
+		.jobs = xmalloc(((size_t)n + 1) * sizeof(struct job)),
+		.njobs = 0,
+		.nworkers = b->jobs > 0 ? b->jobs : 1,
+	};
+	const size_t dirlen = strlen(b->dir);
+	for (int i = 0; i < n; i++) {
+		struct job *job = &pool.jobs[pool.njobs];
+		const size_t len = strlen(entries[i]->d_name);
+		job->path = xmalloc(dirlen + len + 2);
+		memcpy(job->path, b->dir, dirlen);
+		job->path[dirlen] = '/';
+		memcpy(job->path + dirlen + 1, entries[i]->d_name, len + 1);
+		job->name = job->path + dirlen + 1;
+		free(entries[i]);
+
+		struct stat st;
+		if (stat(job->path, &st) < 0 || !S_ISREG(st.st_mode)) {
+			free(job->path);
+			continue;
+		}
+		job->out = job->err = NULL;
+		job->fd = -1;
+		job->status = 0;
+		job->done = 0;
+		job->pool = &pool;
+		job->task = (struct task){0};
+		pool.njobs++;
+	}
+	free(entries);
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	const double start = now();
+	struct worker *workers = NULL;
+	struct scheduler *sched = NULL;
+	if (b->quantum != 0) {
+		sched = sched_init(pool.nworkers, b->quantum, pool.nworkers * ACTIVE_JOBS);
+		for (size_t i = 0; i < pool.njobs; i++) {
+			struct job *job = &pool.jobs[i];
+			job->task = (struct task){
+				.code = (struct code *)code,
+				.fuel_limit = b->fuel_limit,
+				.cpu_limit = b->cpu_limit,
+				.start = task_start,
+				.finish = task_finish,
+				.arg = job,
+			};
+			sched_submit(sched, &job->task);
+		}
+	} else {
+		/* Deal the jobs in turn, so that the first ones finish first. */
+		pool.queues = xmalloc(pool.nworkers * sizeof(struct queue));
+		for (unsigned int w = 0; w < pool.nworkers; w++) {
+			struct queue *q = &pool.queues[w];
+			pthread_mutex_init(&q->lock, NULL);
+			q->jobs = xmalloc((pool.njobs / pool.nworkers + 1) * sizeof(size_t));
+			q->head = q->tail = 0;
+		}
+		for (size_t i = 0; i < pool.njobs; i++) {
+			struct queue *q = &pool.queues[i % pool.nworkers];
+			q->jobs[q->tail++] = i;
+		}
+
+		workers = xmalloc(pool.nworkers * sizeof(struct worker));
+		for (unsigned int w = 0; w < pool.nworkers; w++) {
+			workers[w].pool = &pool;
+			workers[w].id = w;
+			if (pthread_create(&workers[w].thread, NULL, work, &workers[w]) != 0) {
+				fprintf(stderr, "sem: cannot create a thread\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	/* Print each job as soon as it and the ones before it are done. */
+	size_t failed = 0;
+	uint64_t opcodes = 0;
+	uint64_t cpu = 0;
+	for (size_t i = 0; i < pool.njobs; i++) {
+		struct job *job = &pool.jobs[i];
+		pthread_mutex_lock(&pool.lock);
+		while (!job->done) {
+			pthread_cond_wait(&pool.done, &pool.lock);
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		printf("==> %s <==\n", job->name);
+		copy(job->out, stdout);
+		fflush(stdout);
+		copy(job->err, stderr);
+		failed += job->status < 0;
+		opcodes += job->task.fuel_used;
+		cpu += job->task.cpu_used;
+		free(job->path);
+	}
+
+	if (sched != NULL) {
+		sched_destroy(sched);
+	} else {
+		for (unsigned int w = 0; w < pool.nworkers; w++) {
+			pthread_join(workers[w].thread, NULL);
+		}
+	}
+	const double elapsed = now() - start;
+
+	fprintf(stderr, "sem: %zu jobs, %zu failed, %u threads, %.3f s, %.1f jobs/s\n",
+		pool.njobs, failed, pool.nworkers, elapsed,
+		elapsed > 0 ? (double)pool.njobs / elapsed : 0.0);
+	if (sched != NULL) {
+		fprintf(stderr, "sem: %" PRIu64 " opcodes, %.3f s of CPU\n", opcodes, (double)cpu / 1e9);
+	}
+
+	for (unsigned int w = 0; sched == NULL && w < pool.nworkers; w++) {
+		pthread_mutex_destroy(&pool.queues[w].lock);
+		free(pool.queues[w].jobs);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.done);
+	free(pool.queues);
+	free(workers);
+	free(pool.jobs);
+	return failed ? -1 : 0;
+}
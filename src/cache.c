@@ -0,0 +1,351 @@
+/*
+ * cache.c -- The bytecode files
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * A bytecode file (.semc) is the compiled code as it is in memory, so
+ * that loading it is a single mmap:
+ *
+ *   header
+ *   instrs    ninstrs struct instr
+ *   jumps     size size_t
+ *   loops     nloops struct loop
+ *   strings   strings_size bytes, the string pool
+ *   filename  filename_size bytes, the source, '\0' terminated
+ *
+ * The header records the layout of this build (the opcodes, the size
+ * of an instruction and of size_t, the byte order); a file written by
+ * another build does not load, and is compiled again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sem.h"
+
+enum { SEMC_VERSION = 2 };
+
+static const char semc_magic[8] = "SEMC\r\n\032\n";
+
+struct semc_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order; /* 0x01020304, as written */
+	uint32_t nopcodes;
+	uint32_t instr_size;
+	uint32_t word_size; /* sizeof(size_t) */
+	uint32_t optimized;
+	uint64_t hash; /* of the source */
+	uint64_t ninstrs;
+	uint64_t size;
+	uint64_t nloops;
+	uint64_t strings_size;
+	uint64_t filename_size;
+};
+
+/* FNV-1a of the source, or -1 if it cannot be read. */
+int source_hash(const char *filename, uint64_t *hash)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	uint64_t h = FNV1A_SEED;
+	unsigned char buf[64 * 1024];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		h = fnv1a(h, buf, n);
+	}
+	const int err = ferror(fp);
+	fclose(fp);
+	*hash = h;
+	return err ? -1 : 0;
+}
+
+static void fill_header(struct semc_header *h, const struct code *code, uint64_t hash)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, semc_magic, sizeof(h->magic));
+	h->version = SEMC_VERSION;
+	h->byte_order = 0x01020304;
+	h->nopcodes = NOPCODES;
+	h->instr_size = sizeof(struct instr);
+	h->word_size = sizeof(size_t);
+	h->optimized = (uint32_t)code->optimized;
+	h->hash = hash;
+	h->ninstrs = code->ninstrs;
+	h->size = code->size;
+	h->nloops = code->nloops;
+	h->strings_size = code->strings_size;
+	h->filename_size = strlen(code->filename) + 1;
+}
+
+static int write_all(int fd, const void *p, size_t n)
+{
+	const char *s = p;
+	while (n > 0) {
+		const ssize_t w = write(fd, s, n);
+		if (w < 0) {
+			return -1;
+		}
+		s += w;
+		n -= (size_t)w;
+	}
+	return 0;
+}
+
+/*
+ * Write the code to a bytecode file, through a temporary file renamed
+ * over it, so that a concurrent run never loads half a file. Returns -1,
+ * after reporting the error unless quiet, if it cannot be written.
+ */
+static int save(const struct code *code, const char *filename, uint64_t hash, int quiet)
+{
+	struct semc_header h;
+	fill_header(&h, code, hash);
+
+	const size_t len = strlen(filename);
+	char *tmp = xmalloc(len + 8);
+	memcpy(tmp, filename, len);
+	memcpy(tmp + len, ".XXXXXX", 8);
+	const int fd = mkstemp(tmp);
+	if (fd < 0) {
+		if (!quiet) {
+			fprintf(stderr, "sem: cannot write '%s'\n", filename);
+		}
+		free(tmp);
+		return -1;
+	}
+	fchmod(fd, 0644);
+
+	int err = write_all(fd, &h, sizeof(h));
+	err |= write_all(fd, code->instrs, code->ninstrs * sizeof(struct instr));
+	err |= write_all(fd, code->jumps, code->size * sizeof(size_t));
+	err |= write_all(fd, code->loops, code->nloops * sizeof(struct loop));
+	err |= write_all(fd, code->strings, code->strings_size);
+	err |= write_all(fd, code->filename, h.filename_size);
+	err |= close(fd);
+	if (err != 0 || rename(tmp, filename) < 0) {
+		if (!quiet) {
+			fprintf(stderr, "sem: cannot write '%s'\n", filename);
+		}
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* Write the code to a bytecode file, for code_load(). */
+int code_save(const struct code *code, const char *filename)
+{
+	uint64_t hash;
+	if (source_hash(code->filename, &hash) < 0) {
+		fprintf(stderr, "sem: cannot read '%s'\n", code->filename);
+		return -1;
+	}
+	return save(code, filename, hash, 0);
+}
+
+/*
+ * Check that the code is what the compiler would emit, as the engines
+ * trust it: opcodes in range, branches to the start of a line, a line
+ * table in order, loops that hold together and strings within the
+ * pool. The depth of the stack and the bounds of addresses are
+ * computed again by load().
+ */
+static int valid_code(const struct code *code)
+{
+	if (code->ninstrs == 0 || code->size == 0 || code->jumps[0] != 0) {
+		return 0;
+	}
+	for (size_t n = 0; n < code->size; n++) {
+		if (code->jumps[n] > code->ninstrs || (n > 0 && code->jumps[n] < code->jumps[n - 1])) {
+			return 0;
+		}
+	}
+
+	for (size_t i = 0; i < code->ninstrs; i++) {
+		const struct instr *ip = &code->instrs[i];
+		if ((unsigned int)ip->opcode >= NOPCODES || ip->opcode == SETLINENO) {
+			return 0;
+		}
+		if (is_branch(ip->opcode) && (ip->intv < 0 || (size_t)ip->intv >= code->ninstrs
+					      || code->jumps[code_lineno(code, (size_t)ip->intv) - 1] != (size_t)ip->intv)) {
+			return 0;
+		}
+		if (ip->opcode == LOOP && (ip->intv < 0 || (size_t)ip->intv >= code->nloops)) {
+			return 0;
+		}
+		if (ip->opcode == WRITE_STR || ip->opcode == WRITELN_STR) {
+			if (ip->intv < (int)sizeof(uint32_t) || (size_t)ip->intv >= code->strings_size) {
+				return 0;
+			}
+			const size_t len = code_strlen(code->strings + ip->intv);
+			if (len >= code->strings_size - (size_t)ip->intv
+			    || code->strings[(size_t)ip->intv + len] != '\0') {
+				return 0;
+			}
+		}
+	}
+
+	for (size_t k = 0; k < code->nloops; k++) {
+		if (!valid_loop(code, &code->loops[k])) {
+			return 0;
+		}
+	}
+
+	/* The code cannot run past its end. */
+	const opcode_t last = code->instrs[code->ninstrs - 1].opcode;
+	return last == HALT || last == JUMP || last == JUMPT || is_branch(last);
+}
+
+/*
+ * Map a bytecode file, returning its code. If hash is not NULL, the
+ * file must be a cache of a source with that hash, compiled with the
+ * same optimize flag, and a mismatch is not reported.
+ */
+static struct code *load(const char *filename, const uint64_t *hash, int optimize)
+{
+	const int quiet = hash != NULL;
+	const int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		if (!quiet) {
+			fprintf(stderr, "sem: cannot open '%s'\n", filename);
+		}
+		return NULL;
+	}
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct semc_header)) {
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		if (!quiet) {
+			fprintf(stderr, "sem: invalid bytecode file '%s'\n", filename);
+		}
+		return NULL;
+	}
+
+	const size_t mapsize = (size_t)st.st_size;
+	const struct semc_header *h = map;
+
+	/* The header, then the sizes, without overflows. */
+	int ok = memcmp(h->magic, semc_magic, sizeof(h->magic)) == 0
+		&& h->version == SEMC_VERSION && h->byte_order == 0x01020304
+		&& h->nopcodes == NOPCODES && h->instr_size == sizeof(struct instr)
+		&& h->word_size == sizeof(size_t)
+		&& (hash == NULL || (h->hash == *hash && h->optimized == (uint32_t)optimize));
+	const size_t room = mapsize - sizeof(*h);
+	ok = ok && h->ninstrs <= room / sizeof(struct instr) && h->size <= room / sizeof(size_t)
+		&& h->nloops <= room / sizeof(struct loop)
+		&& h->ninstrs < INT32_MAX && h->size < INT32_MAX
+		&& h->strings_size <= room && h->filename_size <= room
+		&& sizeof(*h) + h->ninstrs * sizeof(struct instr) + h->size * sizeof(size_t)
+		   + h->nloops * sizeof(struct loop) + h->strings_size + h->filename_size == mapsize;
+
+	struct code *code = NULL;
+	if (ok) {
+		char *p = (char *)map + sizeof(*h);
+		code = xmalloc(sizeof(struct code));
+		code->instrs = (struct instr *)p;
+		code->ninstrs = code->capacity = h->ninstrs;
+		p += h->ninstrs * sizeof(struct instr);
+		code->jumps = (size_t *)p;
+		code->size = h->size;
+		p += h->size * sizeof(size_t);
+		code->loops = (struct loop *)p;
+		code->nloops = h->nloops;
+		p += h->nloops * sizeof(struct loop);
+		code->strings = p;
+		code->strings_size = code->strings_capacity = h->strings_size;
+		p += h->strings_size;
+		code->filename = p;
+		arena_init(&code->arena);
+		code->interned = NULL;
+		code->interned_capacity = 0;
+		code->ninterned = 0;
+		code->optimized = (int)h->optimized;
+		code->map = map;
+		code->mapsize = mapsize;
+		code->id = code_new_id();
+		ok = h->filename_size > 0 && p[h->filename_size - 1] == '\0' && valid_code(code)
+			&& stack_depth(code) == 0;
+	}
+
+	if (!ok) {
+		if (code != NULL) {
+			free(code);
+		}
+		munmap(map, mapsize);
+		if (!quiet) {
+			fprintf(stderr, "sem: invalid bytecode file '%s'\n", filename);
+		}
+		return NULL;
+	}
+	bound_addresses(code);
+	return code;
+}
+
+/* Load a bytecode file written by code_save(). */
+struct code *code_load(const char *filename)
+{
+	return load(filename, NULL, 0);
+}
+
+/*
+ * Compile a source through its cache, the bytecode file next to it
+ * (prog.sem is cached in prog.semc): the cache is used if it was
+ * compiled from the same content, else it is written again.
+ */
+struct code *compile_cached(const char *filename, int optimize)
+{
+	uint64_t hash;
+	if (source_hash(filename, &hash) < 0) {
+		return compile_code(filename, optimize);
+	}
+
+	const size_t len = strlen(filename);
+	char *cache = xmalloc(len + 2);
+	memcpy(cache, filename, len);
+	memcpy(cache + len, "c", 2);
+
+	struct code *code = load(cache, &hash, optimize);
+	if (code != NULL) {
+		/* The source may have been compiled under another name. */
+		code->filename = arena_strdup(&code->arena, filename);
+	} else {
+		code = compile_code(filename, optimize);
+		if (code != NULL) {
+			save(code, cache, hash, 1);
+		}
+	}
+	free(cache);
+	return code;
+}
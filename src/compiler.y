@@ -25,8 +25,11 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 #include "sem.h"
 #include "scanner.h"
 
@@ -101,7 +104,7 @@ none
 
 stmts
 : stmt
-| stmt stmts
+| stmts stmt	/* left recursive: the parser's stack stays shallow */
 ;
 
 stmt    
@@ -258,43 +261,153 @@ static void yyerror(yyscan_t yyscanner, struct code *code, const char *msg)
 		yyget_lineno(yyscanner), yyget_text(yyscanner));
 }
 
-static struct instr *op_init(int opcode, int iv, char *sv)
+/* Hash a string of the pool, as intern() does. */
+static size_t string_hash(const char *s, size_t len)
 {
-	struct instr *op = xmalloc(sizeof(struct instr));
-	op->opcode = opcode;
-	op->intv = iv;
-	op->strv = (sv != NULL) ? xstrdup(sv) : NULL;
-	op->next = NULL;
-	return op;
+	return (size_t)fnv1a(FNV1A_SEED, s, len);
+}
+
+/* Double the interned strings' table, taken from the code's arena. */
+static void grow_interned(struct code *code)
+{
+	const size_t capacity = code->interned_capacity ? 2 * code->interned_capacity : 64;
+	int *slots = arena_alloc(&code->arena, capacity * sizeof(int));
+	memset(slots, 0, capacity * sizeof(int));
+
+	for (size_t i = 0; i < code->interned_capacity; i++) {
+		const int offset = code->interned[i];
+		if (offset == 0) {
+			continue;
+		}
+		const char *s = code->strings + offset;
+		size_t h = string_hash(s, code_strlen(s)) & (capacity - 1);
+		while (slots[h] != 0) {
+			h = (h + 1) & (capacity - 1);
+		}
+		slots[h] = offset;
+	}
+	code->interned = slots;
+	code->interned_capacity = capacity;
+}
+
+/*
+ * Copy a string argument into the string pool, after its length,
+ * returning the offset of the string. Equal strings are stored once.
+ */
+static int intern(struct code *code, const char *sv)
+{
+	const uint32_t len = (uint32_t)strlen(sv);
+	const size_t size = sizeof(len) + len + 1;
+
+	if (2 * (code->ninterned + 1) > code->interned_capacity) {
+		grow_interned(code);
+	}
+	const size_t mask = code->interned_capacity - 1;
+	size_t h = string_hash(sv, len) & mask;
+	for (; code->interned[h] != 0; h = (h + 1) & mask) {
+		const char *s = code->strings + code->interned[h];
+		if (code_strlen(s) == len && memcmp(s, sv, len) == 0) {
+			return code->interned[h];
+		}
+	}
+
+	if (code->strings_size + size > code->strings_capacity) {
+		while (code->strings_size + size > code->strings_capacity) {
+			code->strings_capacity *= 2;
+		}
+		code->strings = xrealloc(code->strings, code->strings_capacity);
+	}
+
+	memcpy(code->strings + code->strings_size, &len, sizeof(len));
+	const size_t offset = code->strings_size + sizeof(len);
+	memcpy(code->strings + offset, sv, len + 1);
+	code->strings_size += size;
+	code->interned[h] = (int)offset;
+	code->ninterned++;
+	return (int)offset;
 }
 
 static void emit(struct code *code, int opcode, int iv, char *sv)
 {
-	struct instr *op = op_init(opcode, iv, sv);
-	code->code->next = op;
-	code->code = op;
+	if (code->ninstrs == code->capacity) {
+		code->capacity *= 2;
+		code->instrs = xrealloc(code->instrs,
+					code->capacity * sizeof(struct instr));
+	}
+
+	struct instr *op = &code->instrs[code->ninstrs++];
+	op->opcode = opcode;
+	op->intv = (sv != NULL) ? intern(code, sv) : iv;
 
 	if (opcode == SETLINENO) {
 		code->size += 1;
 	}
 }
 
-struct code *compile_code(const char *filename)
+/*
+ * Check the literal targets of jump and jumpt, that is a literal first
+ * operand of the statement, popped by the jump itself. Returns -1,
+ * after reporting the error, if one is not a line of the program.
+ */
+static int check_jumps(const struct code *code)
 {
-	FILE *fp;
+	int lineno = 1;
 
-	if ((fp = fopen(filename, "r")) == NULL) {
-		fprintf(stderr, "sem: cannot open '%s'\n", filename);
-		return NULL;
+	for (size_t i = 1; i < code->ninstrs; i++) {
+		const struct instr *op = &code->instrs[i];
+		if (op->opcode == SETLINENO) {
+			lineno = op->intv;
+			continue;
+		}
+		if (op->opcode != INT || op[-1].opcode != SETLINENO) {
+			continue;
+		}
+
+		/* Find the opcode that pops the literal. */
+		int depth = 1;
+		size_t e = i + 1;
+		while (e < code->ninstrs && code->instrs[e].opcode != SETLINENO
+		       && opcode_pops[code->instrs[e].opcode] < depth) {
+			depth += opcode_pushes[code->instrs[e].opcode] - opcode_pops[code->instrs[e].opcode];
+			e++;
+		}
+
+		const int target = op->intv;
+		if (e < code->ninstrs && (code->instrs[e].opcode == JUMP || code->instrs[e].opcode == JUMPT)
+		    && (target < 1 || (size_t)target >= code->size)) {
+			fprintf(stderr, "sem: cannot jump to line %d at line %d\n", target, lineno);
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	struct instr *start = op_init(SETLINENO, 1, NULL);
+/* Compile the source read from fp, closing it; filename names it. */
+static struct code *compile_stream(FILE *fp, const char *filename, int optimize)
+{
 	struct code *code = xmalloc(sizeof(struct code));
-	code->size = 1;
+	code->capacity = 256;
+	code->instrs = xmalloc(code->capacity * sizeof(struct instr));
+	code->ninstrs = 0;
+	code->strings_capacity = 256;
+	code->strings = xmalloc(code->strings_capacity);
+	code->strings_size = 0;
+	code->size = 0;
 	code->jumps = NULL;
-	code->head = start;
-	code->code = start;
-	code->filename = xstrdup(filename);
+	code->loops = NULL;
+	code->nloops = 0;
+	arena_init(&code->arena);
+	code->interned = NULL;
+	code->interned_capacity = 0;
+	code->ninterned = 0;
+	code->filename = arena_strdup(&code->arena, filename);
+	code->depth = 0;
+	code->depth_line = 0;
+	code->optimized = optimize;
+	code->map = NULL;
+	code->mapsize = 0;
+	code->id = code_new_id();
+	emit_op_int(SETLINENO, 1);
 
 	yyscan_t scanner;
 	yylex_init(&scanner);
@@ -308,80 +421,147 @@ struct code *compile_code(const char *filename)
 	yylex_destroy(scanner);
 	fclose(fp);
 
-	if (compile_status != 0) {
+	if (compile_status != 0 || check_jumps(code) < 0) {
+		code_destroy(code);
 		return NULL;
 	}
 
-	DPRINTF("code size = %d\n", code->size);
-	code->jumps = (struct instr **)xmalloc(code->size * sizeof(void *));
+	/* Add, if needed, a trailing HALT opcode. */
+	switch (code->instrs[code->ninstrs - 1].opcode) {
+	case HALT:
+	case JUMP:
+	case JUMPT:
+		/* do nothing */
+		break;
+
+	default:
+		emit_op(HALT);
+		DPRINTF("COMPILE: inserting missing HALT instruction at end");
+	}
+
+	if (optimize) {
+		fold_constants(code);
+	}
+	peephole(code);
+	fuse_loops(code);
+
+	DPRINTF("code size = %zu\n", code->size);
+	code->jumps = arena_alloc(&code->arena, code->size * sizeof(size_t));
 
 	/*
-	 * Jump-table generation. It maps the source's lines with
-	 * the internal code representation. For example the
-	 * internal code representation of:
+	 * Jump-table generation. The line markers (SETLINENO) are only
+	 * needed by the optimizer, so they are removed here, recording
+	 * where each line starts. For example the internal code
+	 * representation of line 19:
 	 *
 	 *   set D[1] + 1, D[0]
 	 *
 	 * will be:
 	 *
-	 *   SETLINENO             19
-	 *   INT                   1
+	 *   INT                   1    <- code->jumps[18]
 	 *   MEM
 	 *   INT                   1
 	 *   ADD
 	 *   INT                   0
 	 *   MEM
 	 *   SET
+	 *
+	 * The same table maps an opcode back to its line; see code_lineno().
+	 * As lines are known here, ip is resolved to the line after its own.
 	 */
-	int j;
-	struct instr *i;
-
-	for (j = 0, i = code->head; i != NULL; i = i->next) {
-		DPRINTF("COMPILE: %p (op=%d,intv=%d,strv=%s)\n", i, i->opcode,
-			i->intv, i->strv);
-		if (i->opcode == SETLINENO) {
-			DPRINTF("COMPILE:  line %d jumps to %p\n", j, i);
-			code->jumps[j++] = i;
+	size_t j = 0;
+	size_t w = 0;
+	int lineno = 0;
+
+	for (size_t i = 0; i < code->ninstrs; i++) {
+		struct instr op = code->instrs[i];
+		DPRINTF("COMPILE: %zu (op=%d,intv=%d)\n", i, op.opcode, op.intv);
+		if (op.opcode == SETLINENO) {
+			DPRINTF("COMPILE:  line %zu jumps to %zu\n", j, w);
+			lineno = op.intv;
+			code->jumps[j++] = w;
+			continue;
+		}
+		if (op.opcode == IP) {
+			op.intv = lineno + 1;
 		}
+		code->instrs[w++] = op;
 	}
+	code->ninstrs = w;
 
-	/* Add, if needed, a trailing HALT opcode. */
-	struct instr *last_instr = code->code;
-	switch (last_instr->opcode) {
-	case HALT:
-	case JUMP:
-	case JUMPT:
-		/* do nothing */
-		break;
-
-	default:
-		emit_op(HALT);
-		DPRINTF("COMPILE: inserting missing HALT instruction at end");
+	/* Branches to a literal line go straight to its first opcode. */
+	for (size_t i = 0; i < code->ninstrs; i++) {
+		if (is_branch(code->instrs[i].opcode)) {
+			code->instrs[i].intv = (int)code->jumps[code->instrs[i].intv - 1];
+		}
 	}
 
+	bound_addresses(code);
+	stack_depth(code);
 	return code;
 }
 
-void code_destroy(struct code *code)
+struct code *compile_code(const char *filename, int optimize)
 {
-	assert(code != NULL);
-	struct instr *i = code->head;
-	struct instr *t;
+	FILE *fp;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "sem: cannot open '%s'\n", filename);
+		return NULL;
+	}
+	return compile_stream(fp, filename, optimize);
+}
 
-	while (i != NULL) {
-		t = i->next;
+/* Compile a program held in memory, as the debugger's conditions. */
+struct code *compile_source(const char *source, const char *name)
+{
+	FILE *fp = fmemopen((void *)source, strlen(source), "r");
 
-		/* Free the string, if needed. */
-		if (i->strv != NULL) {
-			free(i->strv);
-		}
+	if (fp == NULL) {
+		fprintf(stderr, "sem: cannot read '%s'\n", name);
+		return NULL;
+	}
+	return compile_stream(fp, name, 0);
+}
 
-		/* Free this node. */
-		free(i);
-		i = t;
+/*
+ * Return the line of the opcode at index pc, that is the last line
+ * starting at or before it. Lines without code start where the next
+ * one does, so they are skipped.
+ */
+int code_lineno(const struct code *code, size_t pc)
+{
+	size_t lo = 0;
+	size_t hi = code->size;
+
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (code->jumps[mid] <= pc) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	return (int)lo;
+}
 
-	free(code->filename);
-	free(code->jumps);
+/* A new code id, never given before; workers compile at the same time. */
+uint64_t code_new_id(void)
+{
+	static atomic_uint_least64_t next = 1;
+
+	return atomic_fetch_add(&next, 1);
+}
+
+void code_destroy(struct code *code)
+{
+	assert(code != NULL);
+	if (code->map != NULL) {
+		munmap(code->map, code->mapsize);
+	} else {
+		free(code->instrs);
+		free(code->strings);
+	}
+	arena_destroy(&code->arena);
 	free(code);
 }
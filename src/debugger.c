@@ -19,7 +19,9 @@
  * 02111-1307, USA.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "sem.h"
 #include "config.h"
 
@@ -34,6 +36,11 @@ struct debug_state {
 	struct code *code;
 	struct cmd *cmds;
 	char *filename;
+	const char *args; /* what follows the command's name */
+	struct source source;
+	struct breakpoints breaks;
+	struct code **conds; /* the condition of each line's breakpoint, or NULL */
+	size_t watch_words; /* allocated for each of breaks.writes and breaks.reads */
 };
 
 struct cmd {
@@ -56,30 +63,28 @@ enum {
 /* dump */
 static char dump_doc[] = "Dump internal code representation.";
 
-/* *INDENT-OFF* */
-static const char *opstr[] = {	/* TODO: autogenerate these from sem.h */
-	"SETLINENO", 	"SET", 		"JUMP", 	"JUMPT",
-	"INT", 		"READ", 	"WRITE_INT",	"WRITE_STR",
- 	"WRITELN_INT",	"WRITELN_STR",	"MEM", 		"ADD",
-	"SUB", 		"MUL", 		"DIV", 		"MOD",
-	"EQ",		"NE", 		"GT", 		"LT",
-	"GE",		"LE", 		"IP",		"HALT"
+static const char *opstr[] = {
+#define X(op, pops, pushes) #op,
+	OPCODES(X)
+#undef X
 };
-/* *INDENT-ON* */
 
 static int dump_func(struct debug_state *ds)
 {
-	for (struct instr *i = ds->code->head; i != NULL; i = i->next) {
+	const struct code *code = ds->code;
+
+	for (size_t n = 0; n < code->ninstrs; n++) {
+		const struct instr *i = &code->instrs[n];
 		fprintf(stdout, "%-20s\t", opstr[i->opcode]);
 
-		if (i->intv != -1) {
-			fprintf(stdout, "%d\n", i->intv);
-		} else if (i->strv != NULL) {
-			const size_t ridiculously_large_enough = strlen(i->strv) * 2 + 4;
+		if (i->opcode == WRITE_STR || i->opcode == WRITELN_STR) {
+			const char *str = code_string(code, i);
+			const size_t ridiculously_large_enough = strlen(str) * 2 + 4;
 			char tmp[ridiculously_large_enough];
 			fprintf(stdout, "%s\n",
-				unquote(i->strv, tmp,
-					ridiculously_large_enough));
+				unquote(str, tmp, ridiculously_large_enough));
+		} else if (i->intv != -1) {
+			fprintf(stdout, "%d\n", i->intv);
 		} else {
 			fprintf(stdout, "\n");
 		}
@@ -91,10 +96,21 @@ static int dump_func(struct debug_state *ds)
 /* help */
 static char help_doc[] = "Print this help.";
 
+/* The first letter of a command is its alias, if no command before it has it. */
+static char alias_of(const struct debug_state *ds, const struct cmd *cmd)
+{
+	for (const struct cmd *c = ds->cmds; c != cmd; c++) {
+		if (c->name[0] == cmd->name[0]) {
+			return ' ';
+		}
+	}
+	return cmd->name[0];
+}
+
 static int help_func(struct debug_state *ds)
 {
 	for (struct cmd *cmd = ds->cmds; cmd->name != NULL; cmd++) {
-		fprintf(stdout, "%-20s %-10c %-30s\n", cmd->name, cmd->name[0],
+		fprintf(stdout, "%-20s %-10c %-30s\n", cmd->name, alias_of(ds, cmd),
 			cmd->doc);
 	}
 	return CONTINUE;
@@ -106,16 +122,16 @@ static char ip_doc[] = "Print the instruction pointer.";
 static int ip_func(struct debug_state *ds)
 {
 	if (ds->state == RUNNING) {
-		char line[1000];
-		const int lineno = ds->vm->lineno;
-		const char *filename = ds->code->filename;
-		if (fetch_line_from_file(filename, lineno, line, sizeof(line)) < 0) {
+		int len;
+		const int lineno = code_lineno(ds->code, ds->vm->ip);
+		const char *line = source_line(&ds->source, lineno, &len);
+		if (line == nullptr) {
 			printf("cannot fetch line %d from file %s\n", lineno,
-			       filename);
+			       ds->code->filename);
 		} else {
-			opcode_t opcode = ds->vm->ip->opcode;
+			opcode_t opcode = ds->code->instrs[ds->vm->ip].opcode;
 			printf("op = %d %s.\n", opcode, opstr[opcode]);
-			printf("%d %s", lineno, line);
+			printf("%d %.*s\n", lineno, len, line);
 		}
 	} else {
 		printf("Debugger not started.\n");
@@ -124,23 +140,47 @@ static int ip_func(struct debug_state *ds)
 }
 
 /* list */
-static char list_doc[] = "List program source.";
+static char list_doc[] = "List the source: list [N | FROM,TO]; alone, around the current line.";
+
+/* Lines listed before and after the one asked for. */
+enum { LIST_AROUND = 5 };
 
 static int list_func(struct debug_state *ds)
 {
-	FILE *fp = fopen(ds->code->filename, "r");
-
-	if (fp == nullptr) {
-		printf("Failed to open file.\n");
-		return CONTINUE;
+	const struct source *source = &ds->source;
+	long from = 1;
+	long to = source->nlines;
+
+	if (*ds->args != '\0') {
+		char *end;
+		from = strtol(ds->args, &end, 10);
+		if (*end == ',') {
+			to = strtol(end + 1, &end, 10);
+		} else {
+			to = from + LIST_AROUND;
+			from -= LIST_AROUND;
+		}
+		if (*end != '\0' || end == ds->args) {
+			printf("Invalid range '%s'.\n", ds->args);
+			return CONTINUE;
+		}
+	} else if (ds->state == RUNNING) {
+		const int lineno = code_lineno(ds->code, ds->vm->ip);
+		from = lineno - LIST_AROUND;
+		to = lineno + LIST_AROUND;
 	}
 
-	int lineno = 1;
-	char line[1000];
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		printf("%d %s", lineno++, line);
+	if (from < 1) {
+		from = 1;
+	}
+	if (to > source->nlines) {
+		to = source->nlines;
+	}
+	for (int n = (int)from; n <= to; n++) {
+		int len;
+		const char *line = source_line(source, n, &len);
+		printf("%d %.*s\n", n, len, line);
 	}
-	fclose(fp);
 	return CONTINUE;
 }
 
@@ -153,7 +193,7 @@ static int mem_func(struct debug_state *ds)
 		int j;
 		/* Print at most 10 item. */
 		for (j = 0; i < ds->vm->memsize && j < 10; j++) {
-			fprintf(stdout, "%4d ", ds->vm->mem[i++]);
+			fprintf(stdout, "%4d ", vm_load(ds->vm, (size_t)i++));
 		}
 
 		/* Fill the line. */
@@ -189,11 +229,14 @@ static int next_func(struct debug_state *ds)
 	if (ds->state == HALTED) {
 		printf("Not in debug.\n");
 	} else {
-		const struct instr *ip = ds->vm->ip;
+		const struct instr *ip = &ds->code->instrs[ds->vm->ip];
 		const opcode_t opcode = ip->opcode;
+		const int has_str = opcode == WRITE_STR || opcode == WRITELN_STR;
 		printf("%d %s (int=%d,str=%s)\n", opcode, opstr[opcode],
-		       ip->intv, ip->strv);
-		const int sts = eval_code_one_step(ds->vm, ds->code);
+		       has_str ? -1 : ip->intv,
+		       has_str ? code_string(ds->code, ip) : "(null)");
+		struct history *h = ds->breaks.history;
+		const int sts = (h != nullptr) ? history_forward(h, ds->vm, ds->code) : eval_code_one_step(ds->vm, ds->code);
 		if (sts < 0) {
 			printf("Program aborted.\n");
 			ds->state = HALTED;
@@ -206,6 +249,484 @@ static int next_func(struct debug_state *ds)
 	return CONTINUE;
 }
 
+/* break */
+static char break_doc[] = "Stop at a line: break N [if COND], ip in COND being N + 1. Alone, list the breakpoints.";
+
+/* Whether to stop at the breakpoint of a line: its condition holds, or it has none. */
+static int stop_at(void *arg, const int line)
+{
+	struct debug_state *ds = arg;
+	struct code *cond = ds->conds[line];
+
+	if (cond == NULL) {
+		return 1;
+	}
+
+	/*
+	 * A breakpoint is at the start of a line, where the program has
+	 * nothing on the stack: the condition runs on it from the bottom.
+	 */
+	struct vm *vm = ds->vm;
+	const size_t ip = vm->ip;
+	vm->ip = 0;
+	vm->stacktop = vm->stack;
+	const int sts = eval_code_until(vm, cond, nullptr);
+	const int holds = sts < 0 || code_lineno(cond, vm->ip) == 3;
+	vm->ip = ip;
+	vm->stacktop = vm->stack;
+	return holds;
+}
+
+/*
+ * Compile the condition of a breakpoint at a line as the test of a
+ * jumpt, which ends at line 3 when it holds and at line 2 otherwise.
+ * There, ip would be 2: it is replaced with what it is at the line.
+ */
+static struct code *compile_condition(struct debug_state *ds, const int line, const char *test)
+{
+	char ip[16];
+	const int iplen = snprintf(ip, sizeof(ip), "%d", line + 1);
+	const size_t size = strlen(test) * (size_t)iplen + 32;
+	char *source = xmalloc(size);
+	size_t len = (size_t)snprintf(source, size, "jumpt 3, ");
+	for (const char *p = test; *p != '\0';) {
+		size_t n = 1;
+		while (isalnum((unsigned char)p[0]) && isalnum((unsigned char)p[n])) {
+			n++;
+		}
+		if (n == 2 && strncmp(p, "ip", 2) == 0) {
+			memcpy(source + len, ip, (size_t)iplen);
+			len += (size_t)iplen;
+		} else {
+			memcpy(source + len, p, n);
+			len += n;
+		}
+		p += n;
+	}
+	snprintf(source + len, size - len, "\nhalt\nhalt\n");
+	struct code *cond = compile_source(source, "condition");
+	free(source);
+	if (cond == nullptr) {
+		return nullptr;
+	}
+
+	struct vm *vm = ds->vm;
+	if (cond->depth > vm->stacksize) {
+		vm->stack = xrealloc(vm->stack, cond->depth * sizeof(int));
+		vm->stacktop = vm->stack + (vm->stacktop - vm->stack);
+		vm->stacksize = cond->depth;
+	}
+	return cond;
+}
+
+/* The line given as argument, or -1. */
+static int parse_line(struct debug_state *ds, char **rest)
+{
+	const long line = strtol(ds->args, rest, 10);
+
+	if (*rest == ds->args || line < 1 || (size_t)line >= ds->code->size) {
+		printf("Invalid line '%s'.\n", ds->args);
+		return -1;
+	}
+	return (int)line;
+}
+
+static int break_func(struct debug_state *ds)
+{
+	const struct code *code = ds->code;
+
+	if (*ds->args == '\0') {
+		for (int n = 1; (size_t)n < code->size; n++) {
+			if (has_breakpoint(&ds->breaks, n)) {
+				printf("Breakpoint at line %d%s\n", n,
+				       ds->conds[n] != nullptr ? ", with a condition." : ".");
+			}
+		}
+		return CONTINUE;
+	}
+
+	char *rest;
+	int line = parse_line(ds, &rest);
+	if (line < 0) {
+		return CONTINUE;
+	}
+
+	/* A line without code stops at the next one with some. */
+	while ((size_t)line < code->size && code->jumps[line - 1] == code->jumps[line]) {
+		line++;
+	}
+	if ((size_t)line == code->size) {
+		printf("No code at or after line %s.\n", ds->args);
+		return CONTINUE;
+	}
+
+	struct code *cond = nullptr;
+	while (isspace((unsigned char)*rest)) {
+		rest++;
+	}
+	if (strncmp(rest, "if", 2) == 0 && isspace((unsigned char)rest[2])) {
+		cond = compile_condition(ds, line, rest + 3);
+		if (cond == nullptr) {
+			printf("Invalid condition.\n");
+			return CONTINUE;
+		}
+	} else if (*rest != '\0') {
+		printf("Expected 'if' and a condition, not '%s'.\n", rest);
+		return CONTINUE;
+	}
+
+	if (ds->conds[line] != nullptr) {
+		code_destroy(ds->conds[line]);
+	}
+	ds->conds[line] = cond;
+	ds->breaks.lines[line / 64] |= UINT64_C(1) << (line % 64);
+	printf("Breakpoint at line %d.\n", line);
+	return CONTINUE;
+}
+
+/* delete */
+static char delete_doc[] = "Delete the breakpoint at a line: delete N. Alone, all of them.";
+
+static void delete_breakpoint(struct debug_state *ds, const int line)
+{
+	if (ds->conds[line] != nullptr) {
+		code_destroy(ds->conds[line]);
+		ds->conds[line] = nullptr;
+	}
+	ds->breaks.lines[line / 64] &= ~(UINT64_C(1) << (line % 64));
+}
+
+static int delete_func(struct debug_state *ds)
+{
+	if (*ds->args == '\0') {
+		for (int n = 1; (size_t)n < ds->code->size; n++) {
+			delete_breakpoint(ds, n);
+		}
+		return CONTINUE;
+	}
+
+	char *rest;
+	const int line = parse_line(ds, &rest);
+	if (line < 0) {
+		return CONTINUE;
+	}
+	if (!has_breakpoint(&ds->breaks, line)) {
+		printf("No breakpoint at line %d.\n", line);
+		return CONTINUE;
+	}
+	delete_breakpoint(ds, line);
+	return CONTINUE;
+}
+
+/* continue */
+static char continue_doc[] = "Run until a breakpoint, or the end.";
+
+static int continue_func(struct debug_state *ds)
+{
+	if (ds->state == HALTED) {
+		printf("Not in debug.\n");
+		return CONTINUE;
+	}
+
+	const struct breakpoints *bp = &ds->breaks;
+	const int sts = eval_code_until(ds->vm, ds->code, &ds->breaks);
+	if (sts == VM_BREAK || sts == VM_WATCH) {
+		int len;
+		const int lineno = sts == VM_BREAK ? code_lineno(ds->code, ds->vm->ip) : bp->line;
+		const char *line = source_line(&ds->source, lineno, &len);
+		if (sts == VM_BREAK) {
+			printf("Breakpoint, line %d.\n", lineno);
+		} else if (bp->written) {
+			printf("Watchpoint, line %d: D[%d] written, %d -> %d.\n", lineno, bp->addr, bp->before, bp->after);
+		} else {
+			printf("Watchpoint, line %d: D[%d] read, %d.\n", lineno, bp->addr, bp->after);
+		}
+		if (line != nullptr) {
+			printf("%d %.*s\n", lineno, len, line);
+		}
+	} else if (sts < 0) {
+		printf("Program aborted.\n");
+		ds->state = HALTED;
+	} else {
+		printf("Program ended.\n");
+		ds->state = HALTED;
+	}
+	return CONTINUE;
+}
+
+/* watch */
+static char watch_doc[] = "Stop at writes to cells: watch A[-B] [read], at reads too. Alone, list them.";
+
+/* Parse the cells given as argument, A or A-B, into lo and hi. Returns what follows, or nullptr. */
+static const char *parse_cells(struct debug_state *ds, int *lo, int *hi)
+{
+	char *end;
+	const long a = strtol(ds->args, &end, 10);
+	long b = a;
+	int ok = end != ds->args;
+
+	if (ok && *end == '-') {
+		const char *from = end + 1;
+		b = strtol(from, &end, 10);
+		ok = end != from;
+	}
+	if (!ok || a < 0 || b < a || (size_t)b >= ds->vm->memsize) {
+		printf("Invalid cells '%s'.\n", ds->args);
+		return nullptr;
+	}
+	*lo = (int)a;
+	*hi = (int)b;
+	return end;
+}
+
+static void set_bits(uint64_t *bits, const int lo, const int hi, const int on)
+{
+	for (int p = lo; p <= hi; p++) {
+		if (on) {
+			bits[p / 64] |= UINT64_C(1) << (p % 64);
+		} else {
+			bits[p / 64] &= ~(UINT64_C(1) << (p % 64));
+		}
+	}
+}
+
+static int watch_func(struct debug_state *ds)
+{
+	struct breakpoints *bp = &ds->breaks;
+
+	if (*ds->args == '\0') {
+		for (int p = 0; (size_t)p < bp->watch_limit; p++) {
+			if (!is_watched(bp->writes, bp, p)) {
+				continue;
+			}
+			const int reads = is_watched(bp->reads, bp, p);
+			int q = p;
+			while (is_watched(bp->writes, bp, q + 1) && is_watched(bp->reads, bp, q + 1) == reads) {
+				q++;
+			}
+			if (q > p) {
+				printf("Watching D[%d-%d]%s.\n", p, q, reads ? ", reads too" : "");
+			} else {
+				printf("Watching D[%d]%s.\n", p, reads ? ", reads too" : "");
+			}
+			p = q;
+		}
+		return CONTINUE;
+	}
+
+	int lo, hi;
+	const char *rest = parse_cells(ds, &lo, &hi);
+	if (rest == nullptr) {
+		return CONTINUE;
+	}
+	while (isspace((unsigned char)*rest)) {
+		rest++;
+	}
+	const int reads = strcmp(rest, "read") == 0;
+	if (!reads && *rest != '\0') {
+		printf("Expected 'read', not '%s'.\n", rest);
+		return CONTINUE;
+	}
+
+	const size_t words = (size_t)hi / 64 + 1;
+	if (words > ds->watch_words) {
+		bp->writes = xrealloc(bp->writes, words * sizeof(uint64_t));
+		bp->reads = xrealloc(bp->reads, words * sizeof(uint64_t));
+		memset(bp->writes + ds->watch_words, 0, (words - ds->watch_words) * sizeof(uint64_t));
+		memset(bp->reads + ds->watch_words, 0, (words - ds->watch_words) * sizeof(uint64_t));
+		ds->watch_words = words;
+	}
+	set_bits(bp->writes, lo, hi, 1);
+	set_bits(bp->reads, lo, hi, reads);
+	if ((size_t)hi >= bp->watch_limit) {
+		bp->watch_limit = (size_t)hi + 1;
+	}
+	return CONTINUE;
+}
+
+/* unwatch */
+static char unwatch_doc[] = "Stop watching cells: unwatch A[-B]. Alone, all of them.";
+
+static int unwatch_func(struct debug_state *ds)
+{
+	struct breakpoints *bp = &ds->breaks;
+	int lo = 0;
+	int hi = (int)bp->watch_limit - 1;
+
+	if (*ds->args != '\0' && parse_cells(ds, &lo, &hi) == nullptr) {
+		return CONTINUE;
+	}
+	if ((size_t)hi >= bp->watch_limit) {
+		hi = (int)bp->watch_limit - 1;
+	}
+	set_bits(bp->writes, lo, hi, 0);
+	set_bits(bp->reads, lo, hi, 0);
+
+	/* Without watched cells, the program runs on the engine that does not check. */
+	while (bp->watch_limit > 0 && !is_watched(bp->writes, bp, (int)bp->watch_limit - 1)) {
+		bp->watch_limit--;
+	}
+	return CONTINUE;
+}
+
+/* record */
+static char record_doc[] = "Record the steps, to go back: record [N], keeping the last N. record off stops.";
+
+/* Steps recorded by default. */
+enum { HISTORY_STEPS = 1000000 };
+
+static int record_func(struct debug_state *ds)
+{
+	struct history **h = &ds->breaks.history;
+
+	if (strcmp(ds->args, "off") == 0) {
+		if (*h != nullptr) {
+			history_destroy(*h);
+			*h = nullptr;
+		}
+		printf("Not recording.\n");
+		return CONTINUE;
+	}
+	if (*ds->args == '\0' && *h != nullptr) {
+		printf("Recording: steps %llu to %llu, at %llu.\n", (unsigned long long)(*h)->first,
+		       (unsigned long long)(*h)->end, (unsigned long long)(*h)->now);
+		return CONTINUE;
+	}
+
+	long steps = HISTORY_STEPS;
+	if (*ds->args != '\0') {
+		char *end;
+		steps = strtol(ds->args, &end, 10);
+		if (*end != '\0' || steps < 1) {
+			printf("Invalid number of steps '%s'.\n", ds->args);
+			return CONTINUE;
+		}
+	}
+	if (*h != nullptr) {
+		history_destroy(*h);
+	}
+	*h = history_init(ds->vm, (size_t)steps);
+	printf("Recording the last %ld steps, in at most %zu KiB.\n", steps, history_size(*h, ds->vm) / 1024);
+	return CONTINUE;
+}
+
+/* The history, or nullptr, after telling, if not recording. */
+static struct history *recorded(struct debug_state *ds)
+{
+	if (ds->breaks.history == nullptr) {
+		printf("Not recording; see 'record'.\n");
+	}
+	return ds->breaks.history;
+}
+
+/*
+ * Print the step and the line the program is at, after moving in the
+ * history: only then it runs again.
+ */
+static void print_step(struct debug_state *ds)
+{
+	int len;
+	const int lineno = code_lineno(ds->code, ds->vm->ip);
+	const char *line = source_line(&ds->source, lineno, &len);
+
+	/* The program runs again, but continue does not stop right here. */
+	ds->state = RUNNING;
+	ds->breaks.stopped = VM_BREAK;
+	printf("Step %llu, line %d.\n", (unsigned long long)ds->breaks.history->now, lineno);
+	if (line != nullptr) {
+		printf("%d %.*s\n", lineno, len, line);
+	}
+}
+
+/* reverse-next */
+static char reverse_next_doc[] = "Undo the last step.";
+
+static int reverse_next_func(struct debug_state *ds)
+{
+	struct history *h = recorded(ds);
+
+	if (h == nullptr) {
+		return CONTINUE;
+	}
+	if (history_back(h, ds->vm, ds->code) == nullptr) {
+		printf("No more history.\n");
+		return CONTINUE;
+	}
+	print_step(ds);
+	return CONTINUE;
+}
+
+/* reverse-continue */
+static char reverse_continue_doc[] = "Go back to a breakpoint, an access to a watched cell, or the start of the history.";
+
+static int reverse_continue_func(struct debug_state *ds)
+{
+	struct history *h = recorded(ds);
+	const struct breakpoints *bp = &ds->breaks;
+	const struct code *code = ds->code;
+	struct vm *vm = ds->vm;
+
+	if (h == nullptr) {
+		return CONTINUE;
+	}
+	if (h->now == h->first) {
+		printf("No more history.\n");
+		return CONTINUE;
+	}
+	for (;;) {
+		const struct history_step *s = history_back(h, vm, code);
+		if (s == nullptr) {
+			printf("No more history.\n");
+			break;
+		}
+
+		int writes;
+		const int p = vm_access(vm, code, &writes);
+		if (bp->watch_limit > 0 && is_watched(writes ? bp->writes : bp->reads, bp, p)) {
+			if (writes) {
+				printf("Watchpoint: D[%d] written, %d -> %d.\n", p, s->before, s->after);
+			} else {
+				printf("Watchpoint: D[%d] read, %d.\n", p, vm_load(vm, (size_t)p));
+			}
+			break;
+		}
+
+		const int line = code_lineno(code, vm->ip);
+		if (code->jumps[line - 1] == vm->ip && has_breakpoint(bp, line) && stop_at(ds, line)) {
+			printf("Breakpoint, line %d.\n", line);
+			break;
+		}
+	}
+	print_step(ds);
+	return CONTINUE;
+}
+
+/* goto */
+static char goto_doc[] = "Go to a step of the history: goto N, counted from where recording began.";
+
+static int goto_func(struct debug_state *ds)
+{
+	struct history *h = recorded(ds);
+
+	if (h == nullptr) {
+		return CONTINUE;
+	}
+	char *end;
+	const unsigned long long step = strtoull(ds->args, &end, 10);
+	const uint64_t now = h->now;
+	if (end == ds->args || *end != '\0' || history_seek(h, ds->vm, ds->code, step) < 0) {
+		printf("No step '%s' in the history, from %llu to %llu.\n", ds->args,
+		       (unsigned long long)h->first, (unsigned long long)h->end);
+		return CONTINUE;
+	}
+	if (h->now == now) {
+		printf("No more history.\n");
+		return CONTINUE;
+	}
+	print_step(ds);
+	return CONTINUE;
+}
+
 /* quit */
 static char quit_doc[] = "Quit the debugger.";
 
@@ -228,24 +749,19 @@ static int run_func(struct debug_state *ds)
 	if (ds->state == RUNNING) {
 		const int answer = ask_yes_no("Already in debugging. Restart it from the beginning? (y or n)");
 		if (answer) {
-			ds->vm->ip = ds->code->head;
+			ds->vm->ip = 0;
 		}
 	}
 	ds->state = RUNNING;
-	ds->vm->ip = ds->code->head;
+	ds->vm->ip = 0;
+	ds->breaks.stopped = 0;
+	if (ds->breaks.history != nullptr) {
+		history_clear(ds->breaks.history);
+	}
 	printf("Started.\n");
 	return CONTINUE;
 }
 
-/* not implemented */
-static char notimpl_doc[] = "NOT IMPLEMENTED.";
-
-static int notimpl_func(struct debug_state *ds)
-{
-	fprintf(stdout, "Not implemented.\n");
-	return CONTINUE;
-}
-
 static struct cmd cmds[] = {
 	{"dump", dump_doc, dump_func},
 	{"next", next_doc, next_func},
@@ -256,7 +772,15 @@ static struct cmd cmds[] = {
 	{"list", list_doc, list_func},
 	{"quit", quit_doc, quit_func},
 	{"help", help_doc, help_func},
-	{"break", notimpl_doc, notimpl_func},
+	{"break", break_doc, break_func},
+	{"continue", continue_doc, continue_func},
+	{"delete", delete_doc, delete_func},
+	{"watch", watch_doc, watch_func},
+	{"unwatch", unwatch_doc, unwatch_func},
+	{"record", record_doc, record_func},
+	{"reverse-next", reverse_next_doc, reverse_next_func},
+	{"reverse-continue", reverse_continue_doc, reverse_continue_func},
+	{"goto", goto_doc, goto_func},
 	{nullptr, nullptr, nullptr}
 };
 
@@ -274,10 +798,18 @@ static int cmp_by_alias(const char *p, const char *q)
 	return *p == *q;
 }
 
-static int run_command(struct debug_state *ds, const char *cmd_name)
+static int run_command(struct debug_state *ds, char *cmd_name)
 {
 	int (*cmp) (const char *, const char *);
 
+	/* The arguments follow the name. */
+	char *args = cmd_name + strcspn(cmd_name, " \t");
+	if (*args != '\0') {
+		*args++ = '\0';
+		args += strspn(args, " \t");
+	}
+	ds->args = args;
+
 	/* Is the input an alias? */
 	cmp = (strlen(cmd_name) > 1) ? cmp_by_name : cmp_by_alias;
 
@@ -295,13 +827,30 @@ static int run_command(struct debug_state *ds, const char *cmd_name)
 
 int debug_code(struct vm *vm, struct code *code)
 {
-	char cmd_name[20];
+	char cmd_name[256];
 	struct debug_state ds;
 	struct debug_state *pds = &ds;
 	pds->state = HALTED;
 	pds->vm = vm;
 	pds->code = code;
 	pds->cmds = cmds;
+	pds->args = "";
+	/* Without its source, the debugger lists nothing. */
+	source_open(&pds->source, code->filename);
+	pds->breaks.lines = xmalloc((code->size / 64 + 1) * sizeof(uint64_t));
+	memset(pds->breaks.lines, 0, (code->size / 64 + 1) * sizeof(uint64_t));
+	pds->breaks.stop = stop_at;
+	pds->breaks.arg = pds;
+	pds->breaks.writes = nullptr;
+	pds->breaks.reads = nullptr;
+	pds->breaks.watch_limit = 0;
+	pds->breaks.stopped = 0;
+	pds->breaks.history = nullptr;
+	pds->watch_words = 0;
+	pds->conds = xmalloc(code->size * sizeof(struct code *));
+	memset(pds->conds, 0, code->size * sizeof(struct code *));
+	/* The program reads from stdin too: only a line at a time. */
+	vm->in.fp = stdin;
 	fprintf(stdout, "sem %s -- Debugger \n", PACKAGE_VERSION);
 	fprintf(stdout, "Type 'help' to list available commands.\n");
 	for (;;) {
@@ -316,5 +865,18 @@ int debug_code(struct vm *vm, struct code *code)
 			break;
 		}
 	}
+	for (size_t n = 0; n < code->size; n++) {
+		if (pds->conds[n] != nullptr) {
+			code_destroy(pds->conds[n]);
+		}
+	}
+	free(pds->conds);
+	free(pds->breaks.lines);
+	free(pds->breaks.writes);
+	free(pds->breaks.reads);
+	if (pds->breaks.history != nullptr) {
+		history_destroy(pds->breaks.history);
+	}
+	source_close(&pds->source);
 	return 0;
 }
@@ -0,0 +1,483 @@
+/*
+ * emit.c -- The C code generator
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * Ahead-of-time compilation: the code is written as a C program, with
+ * the same output, errors and exit status as the interpreter for the
+ * memory size it is emitted for.
+ *
+ * Every line is a labelled block in main(). The stack is known at each
+ * opcode (see stack_depth()), so its slots are locals s0, s1 ... that
+ * the C compiler keeps in registers; they are only gathered into an
+ * array to report an error. Branches to a literal line are gotos, and
+ * computed jumps (jump D[1]) go through a switch on the line. D is a
+ * static array, or allocated if it is too large for one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "sem.h"
+
+extern char **environ;
+
+/* A larger memory is allocated when the program starts. */
+constexpr size_t STATIC_MEMORY = 16 * 1024 * 1024;
+
+static const char prelude[] = "\
+#include <stdio.h>\n\
+#include <stdlib.h>\n\
+#include <stdarg.h>\n\
+#include <stdint.h>\n\
+#include <limits.h>\n\
+\n\
+#if defined(__GNUC__)\n\
+#define COLD __attribute__((cold, noreturn))\n\
+#else\n\
+#define COLD\n\
+#endif\n\
+\n\
+/* Report a runtime error as sem does, with the stack from the top. */\n\
+COLD static void fail(int line, int depth, const int *stack, const char *fmt, ...)\n\
+{\n\
+	va_list ap;\n\
+\n\
+	fflush(stdout);\n\
+	fprintf(stderr, \"sem: \");\n\
+	va_start(ap, fmt);\n\
+	vfprintf(stderr, fmt, ap);\n\
+	va_end(ap);\n\
+	fprintf(stderr, \"\\nline: %d\\nstack: \\n\", line);\n\
+	while (depth > 0) {\n\
+		depth--;\n\
+		fprintf(stderr, \" [%d] %d\\n\", depth, stack[depth]);\n\
+	}\n\
+	exit(255);\n\
+}\n\
+\n\
+static int is_blank(int c)\n\
+{\n\
+	return c == ' ' || (c >= '\\t' && c <= '\\r');\n\
+}\n\
+\n\
+/* Read an integer, as sem does. */\n\
+static int read_int(int line, int depth, const int *stack)\n\
+{\n\
+	static char *tok;\n\
+	static size_t cap;\n\
+	size_t len = 0;\n\
+	int c;\n\
+\n\
+	fflush(stdout);\n\
+	do {\n\
+		c = getchar();\n\
+	} while (c != EOF && is_blank(c));\n\
+	if (c == EOF) {\n\
+		fail(line, depth, stack, \"EOF during read\");\n\
+	}\n\
+	while (c != EOF && !is_blank(c)) {\n\
+		if (len == cap) {\n\
+			cap = cap ? 2 * cap : 64;\n\
+			tok = realloc(tok, cap);\n\
+			if (tok == NULL) {\n\
+				fail(line, depth, stack, \"out of memory\");\n\
+			}\n\
+		}\n\
+		tok[len++] = (char)c;\n\
+		c = getchar();\n\
+	}\n\
+	if (c != EOF) {\n\
+		ungetc(c, stdin);\n\
+	}\n\
+\n\
+	const char *p = tok;\n\
+	const char *const last = tok + len;\n\
+	const int neg = *p == '-';\n\
+	p += (*p == '-' || *p == '+');\n\
+	const char *const digits = p;\n\
+	uint64_t u = 0;\n\
+	int overflow = 0;\n\
+	unsigned int d;\n\
+	while (p < last && (d = (unsigned int)(*p - '0')) < 10) {\n\
+		overflow |= u > (UINT64_MAX - d) / 10;\n\
+		u = u * 10 + d;\n\
+		p++;\n\
+	}\n\
+\n\
+	const uint64_t limit = neg ? (uint64_t)LONG_MAX + 1 : (uint64_t)LONG_MAX;\n\
+	if (p != digits && (overflow || u > limit)) {\n\
+		fail(line, depth, stack, \"invalid integer literal '%.*s'\", (int)len, tok);\n\
+	}\n\
+	if (p == digits) {\n\
+		fail(line, depth, stack, \"invalid '%c' in integer literal '%.*s' \", *tok, (int)len, tok);\n\
+	}\n\
+	if (p != last) {\n\
+		fail(line, depth, stack, \"invalid '%c' in integer literal '%.*s' \", *p, (int)len, tok);\n\
+	}\n\
+	return (int)(neg ? 0 - u : u);\n\
+}\n\
+\n";
+
+/* An int as a C constant expression, of type int. */
+static void int_text(char *buf, size_t size, int v)
+{
+	if (v == INT_MIN) {
+		snprintf(buf, size, "(-%d - 1)", INT_MAX);
+	} else {
+		snprintf(buf, size, "%d", v);
+	}
+}
+
+static void put_int(FILE *out, int v)
+{
+	char buf[32];
+	int_text(buf, sizeof(buf), v);
+	fputs(buf, out);
+}
+
+/* The stack of depth values, for fail(). */
+static void put_stack(FILE *out, int depth)
+{
+	if (depth <= 0) {
+		fprintf(out, "NULL");
+		return;
+	}
+	fprintf(out, "(const int[]){");
+	for (int i = 0; i < depth; i++) {
+		fprintf(out, i > 0 ? ", s%d" : "s%d", i);
+	}
+	fprintf(out, "}");
+}
+
+/* A string of the pool, with its newline if ln, as a C string literal. */
+static void put_string(FILE *out, const char *s, size_t len, int ln)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < len; i++) {
+		const unsigned char c = (unsigned char)s[i];
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		} else if (c >= ' ' && c < 0x7f && c != '?') {
+			fputc(c, out);
+		} else {
+			fprintf(out, "\\%03o", c);
+		}
+	}
+	fprintf(out, ln ? "\\n\"" : "\"");
+}
+
+/* Fail, in the generated code, with the stack of depth values. */
+static void put_fail(FILE *out, int line, int depth, const char *fmt, const char *arg)
+{
+	fprintf(out, "fail(%d, %d, ", line, depth);
+	put_stack(out, depth);
+	fprintf(out, ", \"%s\"%s%s);", fmt, arg != NULL ? ", " : "", arg != NULL ? arg : "");
+}
+
+static const char *const compare_ops[NOPCODES] = {
+	[EQ] = "==", [NE] = "!=", [GT] = ">", [LT] = "<", [GE] = ">=", [LE] = "<=",
+	[EQI] = "==", [NEI] = "!=", [GTI] = ">", [LTI] = "<", [GEI] = ">=", [LEI] = "<=",
+	[JEQ] = "==", [JNE] = "!=", [JGT] = ">", [JLT] = "<", [JGE] = ">=", [JLE] = "<="
+};
+
+static const char *const arith_ops[NOPCODES] = {
+	[ADD] = "+", [SUB] = "-", [MUL] = "*", [DIV] = "/", [MOD] = "%",
+	[ADDI] = "+", [SUBI] = "-", [MULI] = "*", [DIVI] = "/", [MODI] = "%"
+};
+
+/*
+ * Emit the opcode at pc, of line line, with d values on the stack
+ * before it.
+ */
+static void emit_instr(FILE *out, const struct code *code, size_t memsize, size_t pc, int line, int d)
+{
+	const struct instr *ip = &code->instrs[pc];
+	const opcode_t op = ip->opcode;
+	const int k = ip->intv;
+	const int in_memory = k >= 0 && (size_t)k < memsize;
+	char arg[32];
+
+	fputc('\t', out);
+	switch (op) {
+	case SETLINENO:	/* removed by the compiler */
+		break;
+
+	case LOOP:	/* the C compiler sees the loop as it is */
+		break;
+
+	case INT:
+	case IP:
+		fprintf(out, "s%d = ", d);
+		put_int(out, k);
+		fputc(';', out);
+		break;
+
+	case LOAD:
+		if (in_memory) {
+			fprintf(out, "s%d = D[%d];", d, k);
+		} else {
+			int_text(arg, sizeof(arg), k);
+			put_fail(out, line, d, "invalid memory address %d", arg);
+		}
+		break;
+
+	case STORE:
+		if (in_memory) {
+			fprintf(out, "D[%d] = s%d;", k, d - 1);
+		} else {
+			int_text(arg, sizeof(arg), k);
+			put_fail(out, line, d - 1, "invalid memory address %d for target", arg);
+		}
+		break;
+
+	case MEM:
+	case MEMU:
+		snprintf(arg, sizeof(arg), "s%d", d - 1);
+		if (op == MEM || !in_memory) {
+			fprintf(out, "if ((unsigned int)%s >= MEMSIZE) ", arg);
+			put_fail(out, line, d - 1, "invalid memory address %d", arg);
+			fprintf(out, "\n\t");
+		}
+		fprintf(out, "%s = D[%s];", arg, arg);
+		break;
+
+	case SET:
+	case SETU:
+		snprintf(arg, sizeof(arg), "s%d", d - 2);
+		if (op == SET || !in_memory) {
+			fprintf(out, "if ((unsigned int)%s >= MEMSIZE) ", arg);
+			put_fail(out, line, d - 2, "invalid memory address %d for target", arg);
+			fprintf(out, "\n\t");
+		}
+		fprintf(out, "D[%s] = s%d;", arg, d - 1);
+		break;
+
+	case READ:
+		snprintf(arg, sizeof(arg), "s%d", d - 1);
+		fprintf(out, "if ((unsigned int)%s >= MEMSIZE) ", arg);
+		put_fail(out, line, d - 1, "invalid memory address %d for read", arg);
+		fprintf(out, "\n\tD[%s] = read_int(%d, %d, ", arg, line, d - 1);
+		put_stack(out, d - 1);
+		fprintf(out, ");");
+		break;
+
+	case WRITE_INT:
+	case WRITELN_INT:
+		fprintf(out, "printf(\"%%d%s\", s%d);", op == WRITELN_INT ? "\\n" : "", d - 1);
+		break;
+
+	case WRITE_STR:
+	case WRITELN_STR: {
+		const char *s = code_string(code, ip);
+		const size_t len = code_strlen(s);
+		fprintf(out, "fwrite(");
+		put_string(out, s, len, op == WRITELN_STR);
+		fprintf(out, ", 1, %zu, stdout);", len + (op == WRITELN_STR));
+		break;
+	}
+
+	case ADD:
+	case SUB:
+	case MUL:
+		/* Wrapping around, as in the interpreter. */
+		fprintf(out, "s%d = (int)((unsigned int)s%d %s (unsigned int)s%d);",
+			d - 2, d - 2, arith_ops[op], d - 1);
+		break;
+
+	case DIV:
+	case MOD:
+		fprintf(out, "if (s%d == 0) ", d - 1);
+		put_fail(out, line, d - 2, "division by zero", NULL);
+		fprintf(out, "\n\ts%d %s= s%d;", d - 2, arith_ops[op], d - 1);
+		break;
+
+	case EQ:
+	case NE:
+	case GT:
+	case LT:
+	case GE:
+	case LE:
+		fprintf(out, "s%d = s%d %s s%d;", d - 2, d - 2, compare_ops[op], d - 1);
+		break;
+
+	case ADDI:
+	case SUBI:
+	case MULI:
+		fprintf(out, "s%d = (int)((unsigned int)s%d %s (unsigned int)", d - 1, d - 1, arith_ops[op]);
+		put_int(out, k);
+		fprintf(out, ");");
+		break;
+
+	case DIVI:
+	case MODI:
+		fprintf(out, "s%d %s= ", d - 1, arith_ops[op]);
+		put_int(out, k);
+		fputc(';', out);
+		break;
+
+	case EQI:
+	case NEI:
+	case GTI:
+	case LTI:
+	case GEI:
+	case LEI:
+		fprintf(out, "s%d = s%d %s ", d - 1, d - 1, compare_ops[op]);
+		put_int(out, k);
+		fputc(';', out);
+		break;
+
+	case GOTO:
+		fprintf(out, "goto L%d;", k);
+		break;
+
+	case JEQ:
+	case JNE:
+	case JGT:
+	case JLT:
+	case JGE:
+	case JLE:
+		fprintf(out, "if (s%d %s s%d) goto L%d;", d - 2, compare_ops[op], d - 1, k);
+		break;
+
+	case JUMP:
+		snprintf(arg, sizeof(arg), "s%d", d - 1);
+		fprintf(out, "if (%s < 1 || %s >= %zu) ", arg, arg, code->size);
+		put_fail(out, line, d - 1, "cannot jump to line %d", arg);
+		fprintf(out, "\n\tt = %s; goto jump;", arg);
+		break;
+
+	case JUMPT:
+		/* The target is checked in any case. */
+		snprintf(arg, sizeof(arg), "s%d", d - 2);
+		fprintf(out, "if (%s < 1 || %s >= %zu) ", arg, arg, code->size);
+		put_fail(out, line, d - 2, "cannot jump to line %d", arg);
+		fprintf(out, "\n\tif (s%d) { t = %s; goto jump; }", d - 1, arg);
+		break;
+
+	case HALT:
+		fprintf(out, "goto halt;");
+		break;
+	}
+	fputc('\n', out);
+}
+
+/*
+ * Write the code as a C program, for a memory of memsize cells. Returns
+ * -1 if it cannot be written.
+ */
+int emit_c(FILE *out, const struct code *code, size_t memsize)
+{
+	int computed = 0;
+	for (size_t i = 0; i < code->ninstrs; i++) {
+		computed |= code->instrs[i].opcode == JUMP || code->instrs[i].opcode == JUMPT;
+	}
+
+	fprintf(out, "/* Compiled by sem from %s. */\n\n", code->filename);
+	fputs(prelude, out);
+	fprintf(out, "#define MEMSIZE %zuu\n\n", memsize);
+	if (memsize * sizeof(int) <= STATIC_MEMORY) {
+		fprintf(out, "static int D[%zu];\n\n", memsize > 0 ? memsize : 1);
+	} else {
+		fprintf(out, "static int *D;\n\n");
+	}
+
+	fprintf(out, "int main(void)\n{\n");
+	const int slots = code->depth > 0 ? (int)code->depth : 1;
+	for (int i = 0; i < slots; i++) {
+		fprintf(out, "\tint s%d = 0;\n", i);
+	}
+	if (computed) {
+		fprintf(out, "\tint t;\n");
+	}
+	if (memsize * sizeof(int) > STATIC_MEMORY) {
+		fprintf(out, "\n\tD = calloc(MEMSIZE, sizeof(int));\n");
+		fprintf(out, "\tif (D == NULL) {\n\t\tfprintf(stderr, \"sem: out of memory\\n\");\n\t\treturn 255;\n\t}\n");
+	}
+
+	size_t n = 0;
+	int d = 0;
+	for (size_t pc = 0; pc < code->ninstrs; pc++) {
+		/* Empty lines start where the next one does. */
+		int first = 1;
+		while (n < code->size && code->jumps[n] == pc) {
+			if (first) {
+				fprintf(out, "\nL%zu:\n", pc);
+				first = 0;
+			}
+			fprintf(out, "\t/* line %zu */\n", ++n);
+			d = 0;
+		}
+		const opcode_t op = code->instrs[pc].opcode;
+		emit_instr(out, code, memsize, pc, code_lineno(code, pc), d);
+		d += opcode_pushes[op] - opcode_pops[op];
+	}
+
+	if (computed) {
+		fprintf(out, "\njump:\n\tswitch (t) {\n");
+		for (size_t line = 1; line < code->size; line++) {
+			fprintf(out, "\tcase %zu: goto L%zu;\n", line, code->jumps[line - 1]);
+		}
+		fprintf(out, "\t}\n");
+	}
+	fprintf(out, "\nhalt:\n\treturn 0;\n}\n");
+	return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Compile the code to an executable, through the C compiler: $CC, or cc.
+ * Returns -1, after reporting the error, if it fails.
+ */
+int emit_native(const struct code *code, size_t memsize, const char *output)
+{
+	char source[] = "/tmp/semXXXXXX.c";
+	const int fd = mkstemps(source, 2);
+	FILE *fp = (fd >= 0) ? fdopen(fd, "w") : NULL;
+	if (fp == NULL) {
+		fprintf(stderr, "sem: cannot create a temporary file\n");
+		return -1;
+	}
+	int err = emit_c(fp, code, memsize);
+	err |= fclose(fp);
+	if (err != 0) {
+		fprintf(stderr, "sem: cannot write '%s'\n", source);
+		unlink(source);
+		return -1;
+	}
+
+	const char *cc = getenv("CC");
+	char *argv[] = {
+		(char *)(cc != NULL && *cc != '\0' ? cc : "cc"),
+		(char *)"-O2", (char *)"-o", (char *)output, source, NULL
+	};
+	pid_t pid;
+	int status = -1;
+	if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0
+	    || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "sem: %s failed to compile '%s'\n", argv[0], code->filename);
+		status = -1;
+	}
+	unlink(source);
+	return status == 0 ? 0 : -1;
+}
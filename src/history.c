@@ -0,0 +1,261 @@
+/*
+ * history.c -- The debugger's history
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * While the debugger records, every opcode run is a step, numbered
+ * from 0 where recording began (record, or run while recording,
+ * starts again from 0, wherever the program is). A step keeps what it
+ * changed: the values it popped and pushed, the cell it wrote, and
+ * where it went next. That is enough to undo it, and to redo it
+ * without running it again, so that going forward over steps already
+ * recorded does not read the input twice (nor write the output).
+ *
+ * The steps are kept in a ring: only the last ones can be undone, and
+ * the memory it takes is fixed when recording starts. Besides, every
+ * so many steps (at least as many as the cells of the memory, so that
+ * they take less than the steps) the whole state is copied into a
+ * checkpoint. Seeking a step then starts from the nearest of where
+ * the vm is and the checkpoints around the step, which makes it cost
+ * about the same however far the step is. A sparse memory has no
+ * checkpoints.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sem.h"
+
+/* Steps between checkpoints, at least. */
+constexpr uint64_t CHECKPOINT_STEPS = 1024;
+
+static const int pops[] = {
+#define X(op, npops, npushes) [op] = npops,
+	OPCODES(X)
+#undef X
+};
+
+static const int pushes[] = {
+#define X(op, npops, npushes) [op] = npushes,
+	OPCODES(X)
+#undef X
+};
+
+struct history *history_init(const struct vm *vm, const size_t steps)
+{
+	struct history *h = xmalloc(sizeof(struct history));
+	h->steps = xmalloc(steps * sizeof(struct history_step));
+	h->capacity = steps;
+	h->every = vm->memsize > CHECKPOINT_STEPS ? vm->memsize : CHECKPOINT_STEPS;
+	h->ncheckpoints = (vm->mem != NULL) ? steps / h->every + 2 : 0;
+	h->checkpoints = xmalloc((h->ncheckpoints + 1) * sizeof(struct checkpoint));
+	memset(h->checkpoints, 0, (h->ncheckpoints + 1) * sizeof(struct checkpoint));
+	history_clear(h);
+	return h;
+}
+
+void history_destroy(struct history *h)
+{
+	for (size_t i = 0; i < h->ncheckpoints; i++) {
+		free(h->checkpoints[i].mem);
+		free(h->checkpoints[i].stack);
+	}
+	free(h->checkpoints);
+	free(h->steps);
+	free(h);
+}
+
+/* Forget every step, as the program starts again. */
+void history_clear(struct history *h)
+{
+	h->first = 0;
+	h->now = 0;
+	h->end = 0;
+	for (size_t i = 0; i < h->ncheckpoints; i++) {
+		h->checkpoints[i].step = UINT64_MAX;
+	}
+}
+
+/* The bytes taken by the steps and the checkpoints. */
+size_t history_size(const struct history *h, const struct vm *vm)
+{
+	return h->capacity * sizeof(struct history_step)
+	    + h->ncheckpoints * (vm->memsize + vm->stacksize) * sizeof(int);
+}
+
+static void checkpoint_take(struct history *h, const struct vm *vm)
+{
+	struct checkpoint *c = &h->checkpoints[(h->now / h->every) % h->ncheckpoints];
+	const size_t depth = (size_t)(vm->stacktop - vm->stack);
+
+	if (c->mem == NULL) {
+		c->mem = xmalloc(vm->memsize * sizeof(int));
+	}
+	c->stack = xrealloc(c->stack, (depth + 1) * sizeof(int));
+	memcpy(c->mem, vm->mem, vm->memsize * sizeof(int));
+	memcpy(c->stack, vm->stack, depth * sizeof(int));
+	c->depth = depth;
+	c->ip = vm->ip;
+	c->step = h->now;
+}
+
+static void checkpoint_restore(struct history *h, struct vm *vm, const struct checkpoint *c)
+{
+	memcpy(vm->mem, c->mem, vm->memsize * sizeof(int));
+	memcpy(vm->stack, c->stack, c->depth * sizeof(int));
+	vm->stacktop = vm->stack + c->depth;
+	vm->ip = c->ip;
+	h->now = c->step;
+}
+
+/* The checkpoint of a step, if it is still in the history. */
+static const struct checkpoint *checkpoint_at(const struct history *h, const uint64_t step)
+{
+	if (h->ncheckpoints == 0 || step < h->first || step > h->end) {
+		return NULL;
+	}
+	const struct checkpoint *c = &h->checkpoints[(step / h->every) % h->ncheckpoints];
+	return c->step == step ? c : NULL;
+}
+
+/*
+ * Run a step, recording it; or, if the vm is back in the history,
+ * redo the next one. Returns as eval_code_one_step(), or -1 if the
+ * stack does not hold what the opcode pops.
+ */
+int history_forward(struct history *h, struct vm *vm, struct code *code)
+{
+	if (h->now < h->end) {
+		const struct history_step *s = &h->steps[h->now % h->capacity];
+		const opcode_t opcode = code->instrs[s->ip].opcode;
+		vm->stacktop = vm->stack + s->depth - pops[opcode];
+		if (pushes[opcode] > 0) {
+			*vm->stacktop++ = s->pushed;
+		}
+		if (s->addr >= 0) {
+			vm_store(vm, (size_t)s->addr, s->after);
+		}
+		vm->ip = s->next;
+		h->now++;
+		return 0;
+	}
+
+	struct history_step s;
+	const opcode_t opcode = code->instrs[vm->ip].opcode;
+	if (vm->stacktop - vm->stack < pops[opcode]) {
+		/* As after an error, which empties the stack: no step to take. */
+		vm_error(vm, code_lineno(code, vm->ip), vm->stacktop, "not enough values on the stack");
+		return -1;
+	}
+	int writes;
+	const int p = vm_access(vm, code, &writes);
+	s.ip = (uint32_t)vm->ip;
+	s.depth = (uint32_t)(vm->stacktop - vm->stack);
+	s.popped[0] = pops[opcode] > 0 ? vm->stacktop[-1] : 0;
+	s.popped[1] = pops[opcode] > 1 ? vm->stacktop[-2] : 0;
+	s.addr = (writes && p >= 0 && (size_t)p < vm->memsize) ? p : -1;
+	s.before = s.addr >= 0 ? vm_load(vm, (size_t)p) : 0;
+
+	const int sts = eval_code_one_step(vm, code);
+	if (sts != 0) {
+		/* Nothing changed, but an error emptied the stack. */
+		vm->stacktop = vm->stack + s.depth;
+		return sts;
+	}
+	s.pushed = pushes[opcode] > 0 ? vm->stacktop[-1] : 0;
+	s.after = s.addr >= 0 ? vm_load(vm, (size_t)p) : 0;
+	s.next = (uint32_t)vm->ip;
+
+	h->steps[h->end % h->capacity] = s;
+	h->end++;
+	h->now++;
+	if (h->end - h->first > h->capacity) {
+		h->first++;
+	}
+	if (h->ncheckpoints > 0 && h->now % h->every == 0) {
+		checkpoint_take(h, vm);
+	}
+	return 0;
+}
+
+/* Undo the last step. Returns it, or NULL at the start of the history. */
+const struct history_step *history_back(struct history *h, struct vm *vm, const struct code *code)
+{
+	if (h->now == h->first) {
+		return NULL;
+	}
+	h->now--;
+	const struct history_step *s = &h->steps[h->now % h->capacity];
+	const opcode_t opcode = code->instrs[s->ip].opcode;
+	if (s->addr >= 0) {
+		vm_store(vm, (size_t)s->addr, s->before);
+	}
+	vm->stacktop = vm->stack + s->depth;
+	if (pops[opcode] > 0) {
+		vm->stacktop[-1] = s->popped[0];
+	}
+	if (pops[opcode] > 1) {
+		vm->stacktop[-2] = s->popped[1];
+	}
+	vm->ip = s->ip;
+	return s;
+}
+
+static uint64_t distance(const uint64_t a, const uint64_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/*
+ * Go to a step of the history, from the nearest of where the vm is and
+ * the checkpoints before and after the step. Returns -1 if the step is
+ * not in the history.
+ */
+int history_seek(struct history *h, struct vm *vm, struct code *code, const uint64_t step)
+{
+	if (step < h->first || step > h->end) {
+		return -1;
+	}
+
+	const uint64_t below = step - step % h->every;
+	const struct checkpoint *candidates[] = {
+		checkpoint_at(h, below),
+		checkpoint_at(h, below + h->every),
+	};
+	const struct checkpoint *from = NULL;
+	uint64_t cost = distance(h->now, step);
+	for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+		if (candidates[i] != NULL && distance(candidates[i]->step, step) < cost) {
+			from = candidates[i];
+			cost = distance(from->step, step);
+		}
+	}
+	if (from != NULL) {
+		checkpoint_restore(h, vm, from);
+	}
+
+	while (h->now > step) {
+		history_back(h, vm, code);
+	}
+	while (h->now < step) {
+		history_forward(h, vm, code);
+	}
+	return 0;
+}
@@ -1,5 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "sem.h"
 
 // Display a prompt, read from stdin, dropping \n before returning the user input. Return -1 on EOF.  
@@ -27,20 +34,312 @@ int ask_yes_no(const char *question) {
 	} while (1);
 }
 
-int fetch_line_from_file(const char *filename, const int lineno, char *dest,
-                         const int dest_size) {
-	FILE *fp = fopen(filename, "r");
-	if (fp == nullptr) {
+// Map a source file and index its lines. Return -1, after reporting the error, if it cannot be read.
+int source_open(struct source *s, const char *filename) {
+	memset(s, 0, sizeof(*s));
+	const int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "sem: cannot open '%s'\n", filename);
+		if (fd >= 0) {
+			close(fd);
+		}
 		return -1;
 	}
-	int i = 0;
-	while (i++ < lineno) {
-		const char *res = fgets(dest, dest_size, fp);
-		if (res == nullptr) {
-			fclose(fp);
+	s->size = (size_t)st.st_size;
+	if (s->size > 0) {
+		void *text = mmap(nullptr, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (text == MAP_FAILED) {
+			fprintf(stderr, "sem: cannot map '%s'\n", filename);
+			close(fd);
 			return -1;
 		}
+		s->text = text;
+	}
+	close(fd);
+
+	// A last line without a newline counts too.
+	size_t n = (s->size > 0 && s->text[s->size - 1] != '\n') ? 1 : 0;
+	for (size_t i = 0; i < s->size; i++) {
+		n += s->text[i] == '\n';
+	}
+	s->lines = xmalloc((n + 1) * sizeof(size_t));
+	s->lines[0] = 0;
+	size_t k = 1;
+	for (size_t i = 0; i < s->size; i++) {
+		if (s->text[i] == '\n') {
+			s->lines[k++] = i + 1;
+		}
 	}
-	fclose(fp);
+	s->lines[n] = s->size;
+	s->nlines = (int)n;
 	return 0;
 }
+
+// Line lineno, setting len to its length without the newline. Return nullptr if there is no such line.
+const char *source_line(const struct source *s, const int lineno, int *len) {
+	if (lineno < 1 || lineno > s->nlines) {
+		return nullptr;
+	}
+	const size_t start = s->lines[lineno - 1];
+	size_t end = s->lines[lineno];
+	if (end > start && s->text[end - 1] == '\n') {
+		end--;
+	}
+	*len = (int)(end - start);
+	return s->text + start;
+}
+
+void source_close(struct source *s) {
+	if (s->text != nullptr) {
+		munmap((void *)s->text, s->size);
+	}
+	free(s->lines);
+	memset(s, 0, sizeof(*s));
+}
+
+void writer_init(struct writer *w, const int fd) {
+	w->fd = fd;
+	w->unbuffered = 0;
+	w->len = 0;
+}
+
+// Write the buffer to fd, after anything pending in stdout if they share it.
+void writer_flush(struct writer *w) {
+	if (w->len == 0) {
+		return;
+	}
+	if (w->fd == STDOUT_FILENO) {
+		fflush(stdout);
+	}
+	const char *p = w->buf;
+	size_t left = w->len;
+	while (left > 0) {
+		const ssize_t n = write(w->fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		p += n;
+		left -= (size_t)n;
+	}
+	w->len = 0;
+}
+
+void writer_str(struct writer *w, const char *s, size_t len) {
+	while (len > 0) {
+		if (w->len == WRITER_SIZE) {
+			writer_flush(w);
+		}
+		const size_t room = WRITER_SIZE - w->len;
+		const size_t n = len < room ? len : room;
+		memcpy(w->buf + w->len, s, n);
+		w->len += n;
+		s += n;
+		len -= n;
+	}
+	if (w->unbuffered) {
+		writer_flush(w);
+	}
+}
+
+void writer_char(struct writer *w, const char c) {
+	if (w->len == WRITER_SIZE) {
+		writer_flush(w);
+	}
+	w->buf[w->len++] = c;
+	if (w->unbuffered) {
+		writer_flush(w);
+	}
+}
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// Format v in decimal, two digits at a time from the end.
+void writer_int(struct writer *w, const int v) {
+	char tmp[16];
+	char *p = tmp + sizeof(tmp);
+	unsigned int u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+
+	while (u >= 100) {
+		const unsigned int r = u % 100;
+		u /= 100;
+		p -= 2;
+		memcpy(p, digit_pairs + 2 * r, 2);
+	}
+	if (u >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + 2 * u, 2);
+	} else {
+		*--p = (char)('0' + u);
+	}
+	if (v < 0) {
+		*--p = '-';
+	}
+	writer_str(w, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+void reader_init(struct reader *r, const int fd) {
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+}
+
+// Give back what was not read, if fd is seekable, and release the buffer.
+void reader_destroy(struct reader *r) {
+	if (r->mapped != 0) {
+		lseek(r->fd, (off_t)r->pos, SEEK_SET);
+		munmap(r->buf, r->mapped);
+	} else {
+		free(r->buf);
+	}
+	r->buf = nullptr;
+}
+
+// Map fd, from its current offset, if it is a regular file. Return 0 if it is not.
+static int reader_map(struct reader *r) {
+	struct stat st;
+	if (fstat(r->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		return 0;
+	}
+	const off_t offset = lseek(r->fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st.st_size) {
+		return 0;
+	}
+	void *buf = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+	if (buf == MAP_FAILED) {
+		return 0;
+	}
+	r->buf = buf;
+	r->mapped = (size_t)st.st_size;
+	r->pos = (size_t)offset;
+	r->len = r->mapped;
+	r->eof = 1;
+	return 1;
+}
+
+// Append more input to the buffer, moving its unread part first. Return 0 at EOF.
+static int reader_fill(struct reader *r) {
+	if (r->eof) {
+		return 0;
+	}
+	if (r->buf == nullptr && r->fp == nullptr && reader_map(r)) {
+		return 1;
+	}
+
+	if (r->pos > 0) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+	}
+	if (r->capacity - r->len < 2) {
+		r->capacity = r->capacity ? 2 * r->capacity : READER_SIZE;
+		r->buf = xrealloc(r->buf, r->capacity);
+	}
+
+	if (r->fp != nullptr) {
+		if (fgets(r->buf + r->len, (int)(r->capacity - r->len), r->fp) == nullptr) {
+			return 0;
+		}
+		r->len += strlen(r->buf + r->len);
+		return 1;
+	}
+
+	ssize_t n;
+	do {
+		n = read(r->fd, r->buf + r->len, r->capacity - r->len);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) {
+		r->eof = 1;
+		return 0;
+	}
+	r->len += (size_t)n;
+	return 1;
+}
+
+static inline int is_blank(const char c) {
+	return c == ' ' || (unsigned char)(c - '\t') < 5;
+}
+
+/*
+ * Read the next integer, as strtol() would parse it in base 10 but
+ * without leading blanks, which separate integers. On READ_RANGE and
+ * READ_INVALID, token is the offending text and bad the first invalid
+ * character; a value in the range of long but not of int is truncated.
+ */
+enum read_status reader_int(struct reader *r, int *v) {
+	// Skip blanks.
+	for (;;) {
+		while (r->pos < r->len && is_blank(r->buf[r->pos])) {
+			r->pos++;
+		}
+		if (r->pos < r->len) {
+			break;
+		}
+		if (!reader_fill(r)) {
+			return READ_EOF;
+		}
+	}
+
+	// Find the end of the token, which must be in the buffer as a whole.
+	size_t end = r->pos;
+	for (;;) {
+		while (end < r->len && !is_blank(r->buf[end])) {
+			end++;
+		}
+		if (end < r->len) {
+			break;
+		}
+		// Filling moves the unread part, the token included, even at EOF.
+		const size_t n = end - r->pos;
+		const int more = reader_fill(r);
+		end = r->pos + n;
+		if (!more) {
+			break;
+		}
+	}
+
+	const char *p = r->buf + r->pos;
+	const char *const last = r->buf + end;
+	r->token = p;
+	r->toklen = (size_t)(last - p);
+	r->pos = end;
+
+	const int neg = *p == '-';
+	p += (*p == '-' || *p == '+');
+	const char *const digits = p;
+	uint64_t u = 0;
+	int overflow = 0;
+	unsigned int d;
+	while (p < last && (d = (unsigned int)(*p - '0')) < 10) {
+		overflow |= u > (UINT64_MAX - d) / 10;
+		u = u * 10 + d;
+		p++;
+	}
+
+	const uint64_t limit = neg ? (uint64_t)LONG_MAX + 1 : (uint64_t)LONG_MAX;
+	if (p != digits && (overflow || u > limit)) {
+		return READ_RANGE;
+	}
+	if (p == digits) {
+		r->bad = *r->token;
+		return READ_INVALID;
+	}
+	if (p != last) {
+		r->bad = *p;
+		return READ_INVALID;
+	}
+	*v = (int)(neg ? 0 - u : u);
+	return READ_OK;
+}
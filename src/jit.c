@@ -0,0 +1,674 @@
+/*
+ * jit.c -- The x86-64 compiler
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include "sem.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+/*
+ * Every opcode is translated to a fixed template of machine code. The
+ * evaluation stack stays in memory, and the generated code keeps:
+ *
+ *   rbx  stack top (vm->stacktop)
+ *   r12  data memory (vm->mem)
+ *   r13  the vm
+ *   r14  native address of each line, for computed jumps
+ *
+ * Branches to a literal line are native jumps. I/O and error reporting
+ * call back into C; the messages are those of the interpreter. Every
+ * check that can fail branches to a cold block after the code, which
+ * loads the line into r8d for the error report. Pushes are not
+ * checked, as for the interpreter.
+ */
+
+/* Runtime errors, reported by jit_error(). */
+enum {
+	ERR_ADDRESS,
+	ERR_TARGET,
+	ERR_JUMP,
+	ERR_DIVISION,
+	ERR_ABORT,	/* already reported */
+	ERR_HALT,	/* not an error: the program ended */
+	NSTUBS
+};
+
+/* x86 condition codes. */
+enum {
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_L = 0xc,
+	CC_GE = 0xd,
+	CC_LE = 0xe,
+	CC_G = 0xf
+};
+
+struct fixup {
+	size_t at;	/* offset of a rel32 */
+	size_t label;	/* an opcode index, ninstrs + stub, or a cold block */
+};
+
+/* A failed check: report err at line. */
+struct cold {
+	int err;
+	int line;
+};
+
+struct jit {
+	unsigned char *buf;
+	size_t len;
+	size_t *labels;	/* offset of each opcode, then of each stub */
+	struct fixup *fixups;
+	size_t nfixups;
+	struct cold *colds;
+	size_t ncolds;
+	size_t ninstrs;
+	int line;	/* of the opcode being translated */
+};
+
+static void emit(struct jit *j, const unsigned char *bytes, size_t n)
+{
+	memcpy(j->buf + j->len, bytes, n);
+	j->len += n;
+}
+
+#define EMIT(j, ...) \
+	emit((j), (const unsigned char[]){__VA_ARGS__}, sizeof((const unsigned char[]){__VA_ARGS__}))
+
+static void emit32(struct jit *j, int32_t v)
+{
+	memcpy(j->buf + j->len, &v, sizeof(v));
+	j->len += sizeof(v);
+}
+
+static void emit64(struct jit *j, uint64_t v)
+{
+	memcpy(j->buf + j->len, &v, sizeof(v));
+	j->len += sizeof(v);
+}
+
+static void fixup(struct jit *j, size_t label)
+{
+	j->fixups[j->nfixups].at = j->len;
+	j->fixups[j->nfixups].label = label;
+	j->nfixups++;
+	emit32(j, 0);
+}
+
+/* jmp label */
+static void jmp(struct jit *j, size_t label)
+{
+	EMIT(j, 0xe9);
+	fixup(j, label);
+}
+
+/* jcc label */
+static void jcc(struct jit *j, int cc, size_t label)
+{
+	EMIT(j, 0x0f, (unsigned char)(0x80 + cc));
+	fixup(j, label);
+}
+
+static size_t stub(const struct jit *j, int which)
+{
+	return j->ninstrs + (size_t)which;
+}
+
+/* The label of a new cold block, failing with err at the current line. */
+static size_t fail(struct jit *j, int err)
+{
+	j->colds[j->ncolds].err = err;
+	j->colds[j->ncolds].line = j->line;
+	return j->ninstrs + NSTUBS + j->ncolds++;
+}
+
+/* mov rax, fn; call rax */
+static void call(struct jit *j, uintptr_t fn)
+{
+	EMIT(j, 0x48, 0xb8);
+	emit64(j, fn);
+	EMIT(j, 0xff, 0xd0);
+}
+
+/* Push eax. */
+static void push_eax(struct jit *j)
+{
+	EMIT(j, 0x89, 0x03);			/* mov [rbx], eax */
+	EMIT(j, 0x48, 0x83, 0xc3, 0x04);	/* add rbx, 4 */
+}
+
+/* Pop into eax. */
+static void pop_eax(struct jit *j)
+{
+	EMIT(j, 0x48, 0x83, 0xeb, 0x04);	/* sub rbx, 4 */
+	EMIT(j, 0x8b, 0x03);			/* mov eax, [rbx] */
+}
+
+/* Fail with err unless 0 <= eax < memsize. */
+static void check_address(struct jit *j, const struct vm *vm, int err)
+{
+	const int32_t limit = vm->memsize > INT32_MAX ? INT32_MIN : (int32_t)vm->memsize;
+	EMIT(j, 0x3d);				/* cmp eax, memsize */
+	emit32(j, limit);
+	jcc(j, CC_AE, fail(j, err));
+}
+
+static int is_address(const struct vm *vm, int k)
+{
+	return k >= 0 && (size_t)k < vm->memsize;
+}
+
+/* Can D[k] be addressed with a 32-bit displacement? */
+static int is_near(int k)
+{
+	return k <= INT32_MAX / 4;
+}
+
+/*
+ * Computed jump to the line in eax, if edx is not zero. The line is
+ * checked in any case.
+ */
+static void jump_computed(struct jit *j, const struct code *code, int conditional)
+{
+	EMIT(j, 0x8d, 0x48, 0xff);		/* lea ecx, [rax - 1] */
+	EMIT(j, 0x81, 0xf9);			/* cmp ecx, size - 1 */
+	emit32(j, (int32_t)code->size - 1);
+	jcc(j, CC_AE, fail(j, ERR_JUMP));
+	if (conditional) {
+		EMIT(j, 0x85, 0xd2);		/* test edx, edx */
+		EMIT(j, 0x74, 0x04);		/* jz +4 */
+	}
+	EMIT(j, 0x41, 0xff, 0x24, 0xce);	/* jmp [r14 + rcx * 8] */
+}
+
+/* Pop q, then p, and compare them. */
+static void compare(struct jit *j)
+{
+	EMIT(j, 0x48, 0x83, 0xeb, 0x08);	/* sub rbx, 8 */
+	EMIT(j, 0x8b, 0x43, 0x04);		/* mov eax, [rbx + 4] */
+	EMIT(j, 0x39, 0x03);			/* cmp [rbx], eax */
+}
+
+/* Replace the top of the stack with the condition cc. */
+static void set_top(struct jit *j, int cc)
+{
+	EMIT(j, 0x0f, (unsigned char)(0x90 + cc), 0xc0);	/* setcc al */
+	EMIT(j, 0x0f, 0xb6, 0xc0);		/* movzx eax, al */
+	EMIT(j, 0x89, 0x43, 0xfc);		/* mov [rbx - 4], eax */
+}
+
+static void write_int(struct vm *vm, int v)
+{
+	writer_int(&vm->out, v);
+}
+
+static void writeln_int(struct vm *vm, int v)
+{
+	writer_int(&vm->out, v);
+	writer_char(&vm->out, '\n');
+}
+
+static void write_str(struct vm *vm, const char *s, size_t len)
+{
+	writer_str(&vm->out, s, len);
+}
+
+static void writeln_str(struct vm *vm, const char *s, size_t len)
+{
+	writer_str(&vm->out, s, len);
+	writer_char(&vm->out, '\n');
+}
+
+static void jit_error(struct vm *vm, int *sp, int err, int arg, int line)
+{
+	switch (err) {
+	case ERR_ADDRESS:
+		vm_error(vm, line, sp, "invalid memory address %d", arg);
+		break;
+	case ERR_TARGET:
+		vm_error(vm, line, sp, "invalid memory address %d for target", arg);
+		break;
+	case ERR_JUMP:
+		vm_error(vm, line, sp, "cannot jump to line %d", arg);
+		break;
+	case ERR_DIVISION:
+		vm_error(vm, line, sp, "division by zero");
+		break;
+	default:
+		break;
+	}
+}
+
+static int cond_code(opcode_t op)
+{
+	static const signed char codes[NOPCODES] = {
+		[EQ] = CC_E, [NE] = CC_NE, [GT] = CC_G, [LT] = CC_L, [GE] = CC_GE, [LE] = CC_LE,
+		[EQI] = CC_E, [NEI] = CC_NE, [GTI] = CC_G, [LTI] = CC_L, [GEI] = CC_GE, [LEI] = CC_LE,
+		[JEQ] = CC_E, [JNE] = CC_NE, [JGT] = CC_G, [JLT] = CC_L, [JGE] = CC_GE, [JLE] = CC_LE
+	};
+	return codes[op];
+}
+
+/*
+ * Translate the opcode at index i. Returns the number of opcodes
+ * consumed, or 0 if the opcode is not supported.
+ */
+static size_t translate(struct jit *j, const struct vm *vm, const struct code *code, size_t i)
+{
+	const struct instr *ip = &code->instrs[i];
+	const int k = ip->intv;
+
+	switch (ip->opcode) {
+	case SETLINENO:	/* removed by the compiler */
+		break;
+
+	case INT:
+	case IP:
+		EMIT(j, 0xc7, 0x03);		/* mov dword [rbx], k */
+		emit32(j, k);
+		EMIT(j, 0x48, 0x83, 0xc3, 0x04);	/* add rbx, 4 */
+		break;
+
+	case MEM:
+	case MEMU:
+		pop_eax(j);
+		/* MEMU's address is at most k. */
+		if (ip->opcode == MEM || !is_address(vm, k)) {
+			check_address(j, vm, ERR_ADDRESS);
+		}
+		EMIT(j, 0x41, 0x8b, 0x04, 0x84);	/* mov eax, [r12 + rax * 4] */
+		push_eax(j);
+		break;
+
+	case LOAD:
+		if (!is_address(vm, k)) {
+			EMIT(j, 0xb8);
+			emit32(j, k);
+			jmp(j, fail(j, ERR_ADDRESS));
+			break;
+		}
+		if (is_near(k)) {
+			EMIT(j, 0x41, 0x8b, 0x84, 0x24);	/* mov eax, [r12 + 4 * k] */
+			emit32(j, k * 4);
+		} else {
+			EMIT(j, 0xb8);			/* mov eax, k */
+			emit32(j, k);
+			EMIT(j, 0x41, 0x8b, 0x04, 0x84);	/* mov eax, [r12 + rax * 4] */
+		}
+		push_eax(j);
+		break;
+
+	case SET:
+	case SETU:
+		EMIT(j, 0x48, 0x83, 0xeb, 0x08);	/* sub rbx, 8 */
+		EMIT(j, 0x8b, 0x03);		/* mov eax, [rbx] */
+		if (ip->opcode == SET || !is_address(vm, k)) {
+			check_address(j, vm, ERR_TARGET);
+		}
+		EMIT(j, 0x8b, 0x4b, 0x04);	/* mov ecx, [rbx + 4] */
+		EMIT(j, 0x41, 0x89, 0x0c, 0x84);	/* mov [r12 + rax * 4], ecx */
+		break;
+
+	case STORE:
+		pop_eax(j);
+		if (!is_address(vm, k)) {
+			EMIT(j, 0xb8);
+			emit32(j, k);
+			jmp(j, fail(j, ERR_TARGET));
+			break;
+		}
+		if (is_near(k)) {
+			EMIT(j, 0x41, 0x89, 0x84, 0x24);	/* mov [r12 + 4 * k], eax */
+			emit32(j, k * 4);
+		} else {
+			EMIT(j, 0xb9);			/* mov ecx, k */
+			emit32(j, k);
+			EMIT(j, 0x41, 0x89, 0x04, 0x8c);	/* mov [r12 + rcx * 4], eax */
+		}
+		break;
+
+	case READ:
+		EMIT(j, 0x48, 0x83, 0xeb, 0x04);	/* sub rbx, 4 */
+		EMIT(j, 0x4c, 0x89, 0xef);	/* mov rdi, r13 */
+		EMIT(j, 0x8b, 0x0b);		/* mov ecx, [rbx] */
+		EMIT(j, 0x48, 0x89, 0xda);	/* mov rdx, rbx */
+		EMIT(j, 0xbe);			/* mov esi, line */
+		emit32(j, j->line);
+		call(j, (uintptr_t)vm_read);
+		EMIT(j, 0x85, 0xc0);		/* test eax, eax */
+		jcc(j, CC_NE, stub(j, ERR_ABORT));
+		break;
+
+	case WRITE_INT:
+	case WRITELN_INT:
+		EMIT(j, 0x48, 0x83, 0xeb, 0x04);	/* sub rbx, 4 */
+		EMIT(j, 0x4c, 0x89, 0xef);	/* mov rdi, r13 */
+		EMIT(j, 0x8b, 0x33);		/* mov esi, [rbx] */
+		call(j, ip->opcode == WRITE_INT ? (uintptr_t)write_int : (uintptr_t)writeln_int);
+		break;
+
+	case WRITE_STR:
+	case WRITELN_STR:
+		EMIT(j, 0x4c, 0x89, 0xef);	/* mov rdi, r13 */
+		EMIT(j, 0x48, 0xbe);		/* mov rsi, string */
+		emit64(j, (uintptr_t)(code->strings + k));
+		EMIT(j, 0xba);			/* mov edx, length */
+		emit32(j, (int32_t)code_strlen(code->strings + k));
+		call(j, ip->opcode == WRITE_STR ? (uintptr_t)write_str : (uintptr_t)writeln_str);
+		break;
+
+	case ADD:
+		pop_eax(j);
+		EMIT(j, 0x01, 0x43, 0xfc);	/* add [rbx - 4], eax */
+		break;
+
+	case SUB:
+		pop_eax(j);
+		EMIT(j, 0x29, 0x43, 0xfc);	/* sub [rbx - 4], eax */
+		break;
+
+	case MUL:
+		pop_eax(j);
+		EMIT(j, 0x0f, 0xaf, 0x43, 0xfc);	/* imul eax, [rbx - 4] */
+		EMIT(j, 0x89, 0x43, 0xfc);	/* mov [rbx - 4], eax */
+		break;
+
+	case DIV:
+	case MOD:
+		EMIT(j, 0x48, 0x83, 0xeb, 0x08);	/* sub rbx, 8 */
+		EMIT(j, 0x8b, 0x4b, 0x04);	/* mov ecx, [rbx + 4] */
+		EMIT(j, 0x85, 0xc9);		/* test ecx, ecx */
+		jcc(j, CC_E, fail(j, ERR_DIVISION));
+		EMIT(j, 0x8b, 0x03);		/* mov eax, [rbx] */
+		EMIT(j, 0x99);			/* cdq */
+		EMIT(j, 0xf7, 0xf9);		/* idiv ecx */
+		if (ip->opcode == DIV) {
+			EMIT(j, 0x89, 0x03);	/* mov [rbx], eax */
+		} else {
+			EMIT(j, 0x89, 0x13);	/* mov [rbx], edx */
+		}
+		EMIT(j, 0x48, 0x83, 0xc3, 0x04);	/* add rbx, 4 */
+		break;
+
+	case ADDI:
+		EMIT(j, 0x81, 0x43, 0xfc);	/* add dword [rbx - 4], k */
+		emit32(j, k);
+		break;
+
+	case SUBI:
+		EMIT(j, 0x81, 0x6b, 0xfc);	/* sub dword [rbx - 4], k */
+		emit32(j, k);
+		break;
+
+	case MULI:
+		EMIT(j, 0x69, 0x43, 0xfc);	/* imul eax, [rbx - 4], k */
+		emit32(j, k);
+		EMIT(j, 0x89, 0x43, 0xfc);	/* mov [rbx - 4], eax */
+		break;
+
+	case DIVI:
+	case MODI:
+		EMIT(j, 0x8b, 0x43, 0xfc);	/* mov eax, [rbx - 4] */
+		EMIT(j, 0x99);			/* cdq */
+		EMIT(j, 0xb9);			/* mov ecx, k */
+		emit32(j, k);
+		EMIT(j, 0xf7, 0xf9);		/* idiv ecx */
+		if (ip->opcode == DIVI) {
+			EMIT(j, 0x89, 0x43, 0xfc);	/* mov [rbx - 4], eax */
+		} else {
+			EMIT(j, 0x89, 0x53, 0xfc);	/* mov [rbx - 4], edx */
+		}
+		break;
+
+	case EQ:
+	case NE:
+	case GT:
+	case LT:
+	case GE:
+	case LE:
+		pop_eax(j);
+		EMIT(j, 0x39, 0x43, 0xfc);	/* cmp [rbx - 4], eax */
+		set_top(j, cond_code(ip->opcode));
+		break;
+
+	case EQI:
+	case NEI:
+	case GTI:
+	case LTI:
+	case GEI:
+	case LEI:
+		EMIT(j, 0x81, 0x7b, 0xfc);	/* cmp dword [rbx - 4], k */
+		emit32(j, k);
+		set_top(j, cond_code(ip->opcode));
+		break;
+
+	case JEQ:
+	case JNE:
+	case JGT:
+	case JLT:
+	case JGE:
+	case JLE:
+		compare(j);
+		jcc(j, cond_code(ip->opcode), (size_t)k);
+		break;
+
+	case GOTO:
+		jmp(j, (size_t)k);
+		break;
+
+	case LOOP: {
+		/* Go on with the exit or the match of the loop, if it ran. */
+		const struct loop *l = &code->loops[k];
+		const size_t exit = code->jumps[l->exit - 1];
+		const size_t found = (l->kind == LOOP_FIND || l->kind == LOOP_FIND_NOT) ? code->jumps[l->found - 1] : exit;
+		if (exit >= code->ninstrs || found >= code->ninstrs) {
+			break;
+		}
+		EMIT(j, 0x4c, 0x89, 0xef);	/* mov rdi, r13 */
+		EMIT(j, 0x48, 0xbe);		/* mov rsi, code */
+		emit64(j, (uintptr_t)code);
+		EMIT(j, 0xba);			/* mov edx, k */
+		emit32(j, k);
+		EMIT(j, 0x31, 0xc9);		/* xor ecx, ecx */
+		call(j, (uintptr_t)loop_run);
+		EMIT(j, 0x3d);			/* cmp eax, exit */
+		emit32(j, (int32_t)exit);
+		jcc(j, CC_E, exit);
+		if (found != exit) {
+			EMIT(j, 0x3d);		/* cmp eax, found */
+			emit32(j, (int32_t)found);
+			jcc(j, CC_E, found);
+		}
+		break;
+	}
+
+	case JUMP:
+		pop_eax(j);
+		jump_computed(j, code, 0);
+		break;
+
+	case JUMPT:
+		EMIT(j, 0x48, 0x83, 0xeb, 0x08);	/* sub rbx, 8 */
+		EMIT(j, 0x8b, 0x03);		/* mov eax, [rbx] */
+		EMIT(j, 0x8b, 0x53, 0x04);	/* mov edx, [rbx + 4] */
+		jump_computed(j, code, 1);
+		break;
+
+	case HALT:
+		jmp(j, stub(j, ERR_HALT));
+		break;
+
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+typedef int (*native_fn)(struct vm *, int *, int *, void **);
+
+/* Translate the whole program; returns 0 if it cannot. */
+static int compile(struct jit *j, const struct vm *vm, const struct code *code)
+{
+	static_assert(offsetof(struct vm, stacktop) < 128);
+
+	/* Prologue. */
+	EMIT(j, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);	/* push rbx ... r15 */
+	EMIT(j, 0x48, 0x83, 0xec, 0x08);	/* sub rsp, 8 */
+	EMIT(j, 0x49, 0x89, 0xfd);		/* mov r13, rdi */
+	EMIT(j, 0x48, 0x89, 0xf3);		/* mov rbx, rsi */
+	EMIT(j, 0x49, 0x89, 0xd4);		/* mov r12, rdx */
+	EMIT(j, 0x49, 0x89, 0xce);		/* mov r14, rcx */
+
+	size_t line = 0;
+	for (size_t i = 0; i < code->ninstrs;) {
+		while (line < code->size && code->jumps[line] <= i) {
+			line++;
+		}
+		j->line = (int)line;
+		j->labels[i] = j->len;
+		const size_t n = translate(j, vm, code, i);
+		if (n == 0) {
+			return 0;
+		}
+		i += n;
+	}
+
+	for (size_t c = 0; c < j->ncolds; c++) {
+		j->labels[j->ninstrs + NSTUBS + c] = j->len;
+		EMIT(j, 0x41, 0xb8);		/* mov r8d, line */
+		emit32(j, j->colds[c].line);
+		jmp(j, stub(j, j->colds[c].err));
+	}
+
+	/* Errors: report, then return -1. */
+	for (int err = 0; err < ERR_ABORT; err++) {
+		j->labels[stub(j, err)] = j->len;
+		EMIT(j, 0x4c, 0x89, 0xef);	/* mov rdi, r13 */
+		EMIT(j, 0x48, 0x89, 0xde);	/* mov rsi, rbx */
+		EMIT(j, 0xba);			/* mov edx, err */
+		emit32(j, err);
+		EMIT(j, 0x89, 0xc1);		/* mov ecx, eax */
+		call(j, (uintptr_t)jit_error);
+		jmp(j, stub(j, ERR_ABORT));
+	}
+	j->labels[stub(j, ERR_ABORT)] = j->len;
+	EMIT(j, 0xb8);				/* mov eax, -1 */
+	emit32(j, -1);
+	EMIT(j, 0xeb, 0x09);			/* jmp epilogue */
+
+	/* Halt: store the stack top, then return 1. */
+	j->labels[stub(j, ERR_HALT)] = j->len;
+	EMIT(j, 0x49, 0x89, 0x5d, (unsigned char)offsetof(struct vm, stacktop));
+	EMIT(j, 0xb8);				/* mov eax, 1 */
+	emit32(j, 1);
+
+	/* Epilogue. */
+	EMIT(j, 0x48, 0x83, 0xc4, 0x08);	/* add rsp, 8 */
+	EMIT(j, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b);	/* pop r15 ... rbx */
+	EMIT(j, 0xc3);				/* ret */
+
+	for (size_t f = 0; f < j->nfixups; f++) {
+		const size_t at = j->fixups[f].at;
+		const int32_t rel = (int32_t)(j->labels[j->fixups[f].label] - (at + 4));
+		memcpy(j->buf + at, &rel, sizeof(rel));
+	}
+	return 1;
+}
+
+/*
+ * Run the program as x86-64 machine code. Programs that cannot be
+ * translated run in the interpreter.
+ */
+int eval_code_jit(struct vm *vm, struct code *code)
+{
+	/*
+	 * The longest template, with its branches, fits in 64 bytes;
+	 * an opcode has at most two checks, of 11 bytes each.
+	 */
+	const size_t size = code->ninstrs * 96 + NSTUBS * 64 + 256;
+	struct jit j = {
+		.len = 0,
+		.nfixups = 0,
+		.ninstrs = code->ninstrs,
+	};
+
+	if (vm_check_stack(code, vm->stacksize) < 0) {
+		return -1;
+	}
+
+	/* The native code addresses a flat memory. */
+	if (vm->mem == NULL) {
+		return eval_code(vm, code);
+	}
+
+	j.buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j.buf == MAP_FAILED) {
+		return eval_code(vm, code);
+	}
+	j.labels = xmalloc((code->ninstrs * 3 + NSTUBS) * sizeof(size_t));
+	j.fixups = xmalloc((code->ninstrs * 4 + NSTUBS) * sizeof(struct fixup));
+	j.colds = xmalloc(code->ninstrs * 2 * sizeof(struct cold));
+
+	int sts;
+	if (compile(&j, vm, code) && mprotect(j.buf, size, PROT_READ | PROT_EXEC) == 0) {
+		/* The native address of each line. */
+		void **lines = xmalloc(code->size * sizeof(void *));
+		for (size_t n = 0; n + 1 < code->size; n++) {
+			lines[n] = j.buf + j.labels[code->jumps[n]];
+		}
+
+		native_fn fn;
+		memcpy(&fn, &j.buf, sizeof(fn));
+		vm->ip = 0;
+		vm_unshare(vm);
+		sts = fn(vm, vm->stacktop, vm->mem, lines);
+		free(lines);
+		writer_flush(&vm->out);
+		sts = (sts < 0) ? sts : 0;
+	} else {
+		sts = eval_code(vm, code);
+	}
+
+	free(j.colds);
+	free(j.fixups);
+	free(j.labels);
+	munmap(j.buf, size);
+	return sts;
+}
+
+#else
+
+/* Not an x86-64: use the interpreter. */
+int eval_code_jit(struct vm *vm, struct code *code)
+{
+	return eval_code(vm, code);
+}
+
+#endif
@@ -0,0 +1,640 @@
+/*
+ * loops.c -- The loop idioms
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * SIMPLESEM has no block operations: filling, copying, summing or
+ * searching a range of D is a loop of a few lines, each element costing
+ * a dozen opcodes. Such a loop has one of two shapes, for a body of a
+ * single line:
+ *
+ *   h    body                      h    jumpt h+4, D[I] >= n
+ *   h+1  set I, D[I] + 1           h+1  body
+ *   h+2  jumpt h, D[I] < n         h+2  set I, D[I] + 1
+ *                                  h+3  jump h
+ *
+ * where the test can be any of those counting i up to n, and n a literal
+ * or a cell. fuse_loops() finds them, and starts line h with LOOP, which
+ * runs the whole loop at once with memset(), memmove() or a vectorised
+ * kernel, leaving the memory, i included, as the loop would.
+ *
+ * LOOP runs the loop only if it can tell, before changing anything, how
+ * it would go: every cell it reads or writes is in memory, the cells of
+ * i, n and the value are not written by the body, and so on. Otherwise
+ * LOOP does nothing, and the loop runs its own opcodes after it, each
+ * failing as it would; as every iteration comes back to LOOP, it runs
+ * at once what remains as soon as it can.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "sem.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Recognition
+ * ===========
+ *
+ * It runs on the code as the peephole optimizer leaves it, where each
+ * line still starts with SETLINENO and branches are to a line, so that
+ * adding LOOP moves nothing that is already resolved.
+ */
+
+/* The opcodes of a line. */
+struct line {
+	const struct instr *ops;
+	size_t n;
+};
+
+static int is_op(const struct line *l, size_t pos, opcode_t op)
+{
+	return pos < l->n && l->ops[pos].opcode == op;
+}
+
+/* A literal or a cell, at pos: INT k or LOAD k. */
+static int match_operand(const struct line *l, size_t *pos, struct loop_operand *o)
+{
+	if (is_op(l, *pos, INT) || is_op(l, *pos, LOAD)) {
+		o->k = l->ops[*pos].intv;
+		o->cell = l->ops[*pos].opcode == LOAD;
+		(*pos)++;
+		return 1;
+	}
+	return 0;
+}
+
+/* D[var] + offset, at pos. */
+static int match_index(const struct line *l, size_t *pos, int var, int *offset)
+{
+	const size_t p = *pos;
+
+	if (is_op(l, p, INT) && is_op(l, p + 1, LOAD) && l->ops[p + 1].intv == var && is_op(l, p + 2, ADD)) {
+		*offset = l->ops[p].intv;
+		*pos = p + 3;
+		return 1;
+	}
+	if (!is_op(l, p, LOAD) || l->ops[p].intv != var) {
+		return 0;
+	}
+	*offset = 0;
+	*pos = p + 1;
+	if (is_op(l, p + 1, ADDI)) {
+		*offset = l->ops[p + 1].intv;
+		*pos = p + 2;
+	} else if (is_op(l, p + 1, SUBI) && l->ops[p + 1].intv != INT_MIN) {
+		*offset = -l->ops[p + 1].intv;
+		*pos = p + 2;
+	}
+	return 1;
+}
+
+/* set var, D[var] + 1 */
+static int match_increment(const struct line *l, int *var)
+{
+	if (l->n == 3 && is_op(l, 0, LOAD) && is_op(l, 1, ADDI) && l->ops[1].intv == 1
+	    && is_op(l, 2, STORE) && l->ops[2].intv == l->ops[0].intv) {
+		*var = l->ops[0].intv;
+		return 1;
+	}
+	if (l->n == 4 && is_op(l, 0, INT) && l->ops[0].intv == 1 && is_op(l, 1, LOAD)
+	    && is_op(l, 2, ADD) && is_op(l, 3, STORE) && l->ops[3].intv == l->ops[1].intv) {
+		*var = l->ops[1].intv;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The relation of i to the bound that goes on with the loop, for a
+ * branch comparing i (on the left, or not) that goes on, or leaves it.
+ * Zero if it does not count i up.
+ */
+static opcode_t going_on(opcode_t branch, int left, int stays)
+{
+	static const opcode_t stay_left[NOPCODES] = { [JLT] = LT, [JLE] = LE, [JNE] = NE };
+	static const opcode_t stay_right[NOPCODES] = { [JGT] = LT, [JGE] = LE, [JNE] = NE };
+	static const opcode_t leave_left[NOPCODES] = { [JGE] = LT, [JGT] = LE, [JEQ] = NE };
+	static const opcode_t leave_right[NOPCODES] = { [JLE] = LT, [JLT] = LE, [JEQ] = NE };
+
+	if (stays) {
+		return left ? stay_left[branch] : stay_right[branch];
+	}
+	return left ? leave_left[branch] : leave_right[branch];
+}
+
+/* jumpt target, D[var] op bound (or bound op D[var]) */
+static int match_test(const struct line *l, struct loop *loop, int target, int stays)
+{
+	size_t pos = 0;
+	int left;
+
+	if (l->n != 3 || !is_branch(l->ops[2].opcode) || l->ops[2].opcode == GOTO || l->ops[2].intv != target) {
+		return 0;
+	}
+	if (is_op(l, 0, LOAD) && l->ops[0].intv == loop->var) {
+		left = 1;
+		pos = 1;
+		match_operand(l, &pos, &loop->bound);
+	} else {
+		left = 0;
+		match_operand(l, &pos, &loop->bound);
+		if (!is_op(l, pos, LOAD) || l->ops[pos].intv != loop->var) {
+			return 0;
+		}
+		pos++;
+	}
+	if (pos != 2) {
+		return 0;
+	}
+	loop->rel = going_on(l->ops[2].opcode, left, stays);
+	return loop->rel != 0;
+}
+
+/* The body of a loop over var; see struct loop. */
+static int match_body(const struct line *l, struct loop *loop)
+{
+	const int var = loop->var;
+	size_t pos = 0;
+
+	/* set D[var] + dst, value */
+	if (match_index(l, &pos, var, &loop->dst) && match_operand(l, &pos, &loop->value)
+	    && is_op(l, pos, SET) && pos + 1 == l->n) {
+		loop->kind = LOOP_FILL;
+		return 1;
+	}
+
+	/* set D[var] + dst, D[D[var] + src] */
+	memset(&loop->value, 0, sizeof(loop->value));
+	pos = 0;
+	if (match_index(l, &pos, var, &loop->dst) && match_index(l, &pos, var, &loop->src)
+	    && is_op(l, pos, MEM) && is_op(l, pos + 1, SET) && pos + 2 == l->n) {
+		loop->kind = LOOP_COPY;
+		return 1;
+	}
+
+	if (l->n < 3) {
+		return 0;
+	}
+	const struct instr *last = &l->ops[l->n - 1];
+
+	/* set sum, D[sum] + D[D[var] + src], either way round */
+	loop->dst = 0;
+	if (last->opcode == STORE && is_op(l, l->n - 2, ADD)) {
+		loop->kind = LOOP_SUM;
+		loop->sum = last->intv;
+		pos = 0;
+		if (is_op(l, 0, LOAD) && l->ops[0].intv == loop->sum && (pos = 1, match_index(l, &pos, var, &loop->src))
+		    && is_op(l, pos, MEM) && pos + 3 == l->n) {
+			return 1;
+		}
+		pos = 0;
+		return match_index(l, &pos, var, &loop->src) && is_op(l, pos, MEM)
+			&& is_op(l, pos + 1, LOAD) && l->ops[pos + 1].intv == loop->sum && pos + 4 == l->n;
+	}
+
+	/* jumpt found, D[D[var] + src] = value, either way round, or != */
+	if (last->opcode == JEQ || last->opcode == JNE) {
+		loop->kind = (last->opcode == JEQ) ? LOOP_FIND : LOOP_FIND_NOT;
+		loop->found = last->intv;
+		pos = 0;
+		if (match_index(l, &pos, var, &loop->src) && is_op(l, pos, MEM)
+		    && (pos++, match_operand(l, &pos, &loop->value)) && pos + 1 == l->n) {
+			return 1;
+		}
+		pos = 0;
+		return match_operand(l, &pos, &loop->value) && match_index(l, &pos, var, &loop->src)
+			&& is_op(l, pos, MEM) && pos + 2 == l->n;
+	}
+	return 0;
+}
+
+/* Does a loop start at line h? If so, it sets loop and returns its last line. */
+static int match_loop(const struct line *lines, int size, int h, struct loop *loop)
+{
+	memset(loop, 0, sizeof(*loop));
+	loop->head = h;
+
+	/* do ... while */
+	if (h + 3 <= size && match_increment(&lines[h + 1], &loop->var)
+	    && match_test(&lines[h + 2], loop, h, 1) && match_body(&lines[h], loop)) {
+		loop->tested_first = 0;
+		loop->exit = h + 3;
+		loop->len = 1 + (int)(lines[h].n + lines[h + 1].n + lines[h + 2].n);
+		loop->at = (int)lines[h].n;
+		return h + 2;
+	}
+
+	/* while */
+	memset(loop, 0, sizeof(*loop));
+	loop->head = h;
+	if (h + 4 <= size && match_increment(&lines[h + 2], &loop->var)
+	    && lines[h + 3].n == 1 && is_op(&lines[h + 3], 0, GOTO) && lines[h + 3].ops[0].intv == h
+	    && match_test(&lines[h], loop, h + 4, 0) && match_body(&lines[h + 1], loop)) {
+		loop->tested_first = 1;
+		loop->exit = h + 4;
+		loop->len = 1 + (int)(lines[h].n + lines[h + 1].n + lines[h + 2].n + lines[h + 3].n);
+		loop->at = (int)(lines[h].n + lines[h + 1].n);
+		return h + 3;
+	}
+	return 0;
+}
+
+/*
+ * Find the loops that LOOP can run, adding it at the start of the
+ * first line of each; see above. The code still holds SETLINENO.
+ */
+void fuse_loops(struct code *code)
+{
+	const int size = (int)code->size;
+	struct line *lines = xmalloc(((size_t)size + 1) * sizeof(struct line));
+
+	/* Line n is lines[n], after the n-th SETLINENO. */
+	int n = 0;
+	for (size_t i = 0; i < code->ninstrs; i++) {
+		if (code->instrs[i].opcode == SETLINENO) {
+			n++;
+			lines[n].ops = &code->instrs[i + 1];
+			lines[n].n = 0;
+		} else if (n > 0) {
+			lines[n].n++;
+		}
+	}
+
+	struct loop *loops = xmalloc(((size_t)size + 1) * sizeof(struct loop));
+	int *heads = xmalloc(((size_t)size + 1) * sizeof(int));
+	size_t nloops = 0;
+	for (int h = 1; h < size; h++) {
+		heads[h] = -1;
+		const int last = match_loop(lines, size, h, &loops[nloops]);
+		if (last > 0 && valid_loop(code, &loops[nloops])) {
+			heads[h] = (int)nloops++;
+			for (int m = h + 1; m <= last; m++) {
+				heads[m] = -1;
+			}
+			h = last;
+		}
+	}
+
+	code->loops = NULL;
+	code->nloops = nloops;
+	if (nloops > 0) {
+		code->loops = arena_alloc(&code->arena, nloops * sizeof(struct loop));
+		memcpy(code->loops, loops, nloops * sizeof(struct loop));
+
+		struct instr *instrs = xmalloc((code->ninstrs + nloops) * sizeof(struct instr));
+		size_t w = 0;
+		n = 0;
+		for (size_t i = 0; i < code->ninstrs; i++) {
+			instrs[w++] = code->instrs[i];
+			if (code->instrs[i].opcode == SETLINENO && ++n < size && heads[n] >= 0) {
+				instrs[w].opcode = LOOP;
+				instrs[w++].intv = heads[n];
+			}
+		}
+		free(code->instrs);
+		code->instrs = instrs;
+		code->ninstrs = code->capacity = w;
+	}
+
+	free(heads);
+	free(loops);
+	free(lines);
+}
+
+/*
+ * Does the loop hold together? Its lines must exist, and the cells of i,
+ * of the bound, of the value and of the sum must not be one another when
+ * the loop changes one or reads it as another: LOOP trusts that much
+ * from a bytecode file, and checks the rest as it runs.
+ */
+int valid_loop(const struct code *code, const struct loop *l)
+{
+	const int size = (int)code->size;
+	const int last = l->exit - 1;
+	const int finds = l->kind == LOOP_FIND || l->kind == LOOP_FIND_NOT;
+
+	return l->kind >= 0 && l->kind < NLOOP_KINDS
+		&& (l->rel == LT || l->rel == LE || l->rel == NE)
+		&& l->head >= 1 && l->exit == l->head + (l->tested_first ? 4 : 3) && l->exit <= size
+		&& (!finds || ((l->found < l->head || l->found > last) && l->found >= 1 && l->found < size))
+		&& !(l->bound.cell && l->bound.k == l->var)
+		&& !((l->kind == LOOP_FILL || finds) && l->value.cell && l->value.k == l->var)
+		&& !(l->kind == LOOP_SUM && (l->sum == l->var || (l->bound.cell && l->bound.k == l->sum)))
+		&& l->len >= 1 && l->at >= 0;
+}
+
+/*
+ * Kernels
+ * =======
+ *
+ * Where the CPU has AVX2, 8 cells at a time, otherwise 4 with SSE2.
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+__attribute__((target("avx2")))
+static void fill_avx2(int *p, size_t n, int v)
+{
+	const __m256i x = _mm256_set1_epi32(v);
+	size_t j = 0;
+	for (; j + 8 <= n; j += 8) {
+		_mm256_storeu_si256((__m256i *)(p + j), x);
+	}
+	for (; j < n; j++) {
+		p[j] = v;
+	}
+}
+
+__attribute__((target("avx2")))
+static unsigned int sum_avx2(const int *p, size_t n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	size_t j = 0;
+	for (; j + 8 <= n; j += 8) {
+		acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i *)(p + j)));
+	}
+	unsigned int lanes[8];
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	unsigned int s = 0;
+	for (size_t k = 0; k < 8; k++) {
+		s += lanes[k];
+	}
+	for (; j < n; j++) {
+		s += (unsigned int)p[j];
+	}
+	return s;
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2(const int *p, size_t n, int v, int equal)
+{
+	const __m256i x = _mm256_set1_epi32(v);
+	const unsigned int flip = equal ? 0 : 0xff;
+	size_t j = 0;
+	for (; j + 8 <= n; j += 8) {
+		const __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(p + j)), x);
+		const unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) ^ flip;
+		if (mask != 0) {
+			return j + (size_t)__builtin_ctz(mask);
+		}
+	}
+	for (; j < n; j++) {
+		if ((p[j] == v) == equal) {
+			return j;
+		}
+	}
+	return n;
+}
+
+static int has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static void fill_sse2(int *p, size_t n, int v)
+{
+	const __m128i x = _mm_set1_epi32(v);
+	size_t j = 0;
+	for (; j + 4 <= n; j += 4) {
+		_mm_storeu_si128((__m128i *)(p + j), x);
+	}
+	for (; j < n; j++) {
+		p[j] = v;
+	}
+}
+
+static unsigned int sum_sse2(const int *p, size_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	size_t j = 0;
+	for (; j + 4 <= n; j += 4) {
+		acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i *)(p + j)));
+	}
+	unsigned int lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	unsigned int s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (; j < n; j++) {
+		s += (unsigned int)p[j];
+	}
+	return s;
+}
+
+static size_t find_sse2(const int *p, size_t n, int v, int equal)
+{
+	const __m128i x = _mm_set1_epi32(v);
+	const unsigned int flip = equal ? 0 : 0xf;
+	size_t j = 0;
+	for (; j + 4 <= n; j += 4) {
+		const __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + j)), x);
+		const unsigned int mask = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(eq)) ^ flip;
+		if (mask != 0) {
+			return j + (size_t)__builtin_ctz(mask);
+		}
+	}
+	for (; j < n; j++) {
+		if ((p[j] == v) == equal) {
+			return j;
+		}
+	}
+	return n;
+}
+
+#define fill_cells(p, n, v)	(has_avx2() ? fill_avx2(p, n, v) : fill_sse2(p, n, v))
+#define sum_cells(p, n)		(has_avx2() ? sum_avx2(p, n) : sum_sse2(p, n))
+#define find_cells(p, n, v, e)	(has_avx2() ? find_avx2(p, n, v, e) : find_sse2(p, n, v, e))
+
+#else
+
+static void fill_cells(int *p, size_t n, int v)
+{
+	for (size_t j = 0; j < n; j++) {
+		p[j] = v;
+	}
+}
+
+static unsigned int sum_cells(const int *p, size_t n)
+{
+	unsigned int s = 0;
+	for (size_t j = 0; j < n; j++) {
+		s += (unsigned int)p[j];
+	}
+	return s;
+}
+
+static size_t find_cells(const int *p, size_t n, int v, int equal)
+{
+	for (size_t j = 0; j < n; j++) {
+		if ((p[j] == v) == equal) {
+			return j;
+		}
+	}
+	return n;
+}
+
+#endif
+
+/*
+ * Running
+ * =======
+ */
+
+/* Is [lo, lo + n) in a memory of memsize cells? Empty ranges are. */
+static int in_range(int64_t lo, int64_t n, int64_t memsize)
+{
+	return n == 0 || (lo >= 0 && lo + n <= memsize);
+}
+
+static int overlaps(int64_t p, int64_t lo, int64_t n)
+{
+	return p >= lo && p < lo + n;
+}
+
+/*
+ * Run the loop k of the code, from the start of its first line, as its
+ * opcodes would. Returns the opcode to go on with, or -1, having changed
+ * nothing, if its opcodes must run instead; see above. On fuel (if not
+ * NULL), it charges what its opcodes would, and stops where they would,
+ * going on with the first line of the loop.
+ */
+int loop_run(struct vm *vm, const struct code *code, int k, int64_t *fuel)
+{
+	const struct loop *l = &code->loops[k];
+	int *const mem = vm->mem;
+	const int64_t memsize = (int64_t)vm->memsize;
+	const int reads = l->kind != LOOP_FILL;
+	const int writes = l->kind == LOOP_FILL || l->kind == LOOP_COPY;
+
+	if (mem == NULL || !in_range(l->var, 1, memsize)
+	    || (l->bound.cell && !in_range(l->bound.k, 1, memsize))
+	    || (l->value.cell && !in_range(l->value.k, 1, memsize))
+	    || (l->kind == LOOP_SUM && !in_range(l->sum, 1, memsize))) {
+		return -1;
+	}
+
+	/* i goes from i0 up to i0 + n, running the body n times. */
+	const int64_t i0 = mem[l->var];
+	const int64_t bound = l->bound.cell ? mem[l->bound.k] : l->bound.k;
+	const int64_t end = (l->rel == LE) ? bound + 1 : bound;
+	if (l->rel == NE && (l->tested_first ? i0 > bound : i0 >= bound)) {
+		return -1;
+	}
+	int64_t n = (end > i0) ? end - i0 : 0;
+	if (!l->tested_first && n == 0) {
+		n = 1;
+	}
+	if (i0 + n > INT_MAX) {
+		return -1;
+	}
+
+	/*
+	 * On fuel, every iteration but the last of a do ... while jumps back,
+	 * costing the opcodes of the loop; the loop stops at the jump back
+	 * that overspends it, after m iterations.
+	 */
+	const int64_t backs = l->tested_first ? n : n - 1;
+	int64_t m = n;
+	int yields = 0;
+	if (fuel != NULL) {
+		if (*fuel < 0) {
+			return -1;
+		}
+		if (backs > *fuel / l->len) {
+			m = *fuel / l->len + 1;
+			yields = 1;
+		}
+	}
+
+	/* The cells read and written, and what must stay out of them. */
+	const int64_t src = i0 + l->src;
+	const int64_t dst = i0 + l->dst;
+	if ((reads && !in_range(src, m, memsize)) || (writes && !in_range(dst, m, memsize))) {
+		return -1;
+	}
+	if (reads && (overlaps(l->var, src, m) || (l->kind == LOOP_SUM && overlaps(l->sum, src, m)))) {
+		return -1;
+	}
+	if (writes && (overlaps(l->var, dst, m) || (l->bound.cell && overlaps(l->bound.k, dst, m))
+		       || (l->value.cell && overlaps(l->value.k, dst, m)))) {
+		return -1;
+	}
+
+	/* A search stops at the first match, if any. */
+	int64_t ran = m;
+	if (l->kind == LOOP_FIND || l->kind == LOOP_FIND_NOT) {
+		const int v = l->value.cell ? mem[l->value.k] : l->value.k;
+		ran = m > 0 ? (int64_t)find_cells(mem + src, (size_t)m, v, l->kind == LOOP_FIND) : 0;
+	}
+
+	switch (l->kind) {
+	case LOOP_FILL: {
+		const int v = l->value.cell ? mem[l->value.k] : l->value.k;
+		if (v == 0) {
+			memset(mem + dst, 0, (size_t)m * sizeof(int));
+		} else {
+			fill_cells(mem + dst, (size_t)m, v);
+		}
+		break;
+	}
+	case LOOP_COPY:
+		if (dst <= src || dst >= src + m) {
+			memmove(mem + dst, mem + src, (size_t)m * sizeof(int));
+		} else {
+			/* Copying up over itself repeats the cells before dst. */
+			for (int64_t j = 0; j < m; j++) {
+				mem[dst + j] = mem[src + j];
+			}
+		}
+		break;
+	case LOOP_SUM:
+		mem[l->sum] = (int)((unsigned int)mem[l->sum] + sum_cells(mem + src, (size_t)m));
+		break;
+	default:
+		break;
+	}
+	mem[l->var] = (int)(i0 + ran);
+
+	/*
+	 * Where it goes on, charging the fuel as the opcodes would. The
+	 * engine charges the jump from LOOP back to the first line of the
+	 * loop, or to a match before it, which is shorter by l->at.
+	 */
+	const size_t head = code->jumps[l->head - 1];
+	size_t next;
+	int64_t cost;
+	if (ran < m) {
+		next = code->jumps[l->found - 1];
+		cost = ran * l->len + (next <= head ? l->at : 0);
+	} else if (yields) {
+		next = head;
+		cost = m * l->len - 1;
+	} else {
+		next = code->jumps[l->exit - 1];
+		cost = backs * l->len;
+	}
+	if (fuel != NULL) {
+		*fuel -= cost;
+	}
+	return (int)next;
+}
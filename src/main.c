@@ -22,14 +22,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <getopt.h>
+#include <unistd.h>
 #include "sem.h"
 #include "config.h"
 
-constexpr size_t MAX_DATA_SIZE = 1024;
+constexpr size_t MAX_DATA_SIZE = (size_t)INT_MAX + 1; /* addresses are ints */
 constexpr size_t MAX_STACK_SIZE = 1024 ;
 constexpr size_t DEFAULT_DATA_SIZE = 64;
-constexpr size_t DEFAULT_STACK_SIZE = 64;
+constexpr uint64_t DEFAULT_QUANTUM = 1000000;
 
 static char license[] = "\r\
 sem " PACKAGE_VERSION " -- A SIMPLESEM interpreter\n\
@@ -45,29 +49,119 @@ static char help_template[] = "\r\
 Usage: sem [options] file\n\
 \n\
 Options:\n\
+  -a : compile to an executable with the C compiler ($CC, or cc), written to the -o file\n\
+  -b dir : run once for every file in dir, as its input, printing the outputs in order\n\
   -h : print this help message and exit\n\
+  -H : map a large data memory on huge pages, where supported\n\
+  -c : compile only, writing the bytecode to file.semc (or the -o file)\n\
+  -C : cache the bytecode next to the source, as file.semc\n\
   -d : interactive debugger\n\
-  -m : set the data memory size (the default is %zu)\n\
-  -s : set the stack size (the default is %u)\n\
+  -e : write the program as C, to stdout (or the -o file)\n\
+  -f n : stop a run after about n opcodes\n\
+  -F file : profile, writing collapsed stacks for flamegraph.pl to file\n\
+  -j : run as native code, where supported (x86-64)\n\
+  -J n : with -b, run n jobs at a time (the default is the number of processors)\n\
+  -m : set the data memory size (the default is %zu, at most 2147483648)\n\
+  -o file : the file written by -a, -c or -e\n\
+  -O : optimize (fold constant expressions)\n\
+  -p : profile, printing the executions of each line and opcode\n\
+  -P : profile, timing each line too\n\
+  -q n : with -b, run the jobs in turns of about n opcodes (the default with -f or -t is %"PRIu64")\n\
+  -r file : resume the run saved to file by -T, with the memory size it had (with -b, for every input)\n\
+  -s : set the largest stack size (the default is what the program needs)\n\
+  -S : sparse data memory, allocated a page at a time when written\n\
+  -t s : stop a run after s seconds of CPU\n\
+  -T line file : run until line, save the run to file (see -r) and stop\n\
+  -u : unbuffered output, written as soon as the program writes it\n\
   -v : print the version and exit\n\
 \n\
+A file ending in .semc is loaded as bytecode.\n\
+\n\
 Report bugs to <%s>\n";
 
 static void usage(const int sts) {
 	FILE *target = (sts == EXIT_SUCCESS) ? stdout : stderr;
-	fprintf(target, help_template, DEFAULT_DATA_SIZE, DEFAULT_STACK_SIZE, PACKAGE_BUGREPORT);
+	fprintf(target, help_template, DEFAULT_DATA_SIZE, DEFAULT_QUANTUM, PACKAGE_BUGREPORT);
 	exit(sts);
 }
 
+/* Run until the line is reached, then write the snapshot (-T). */
+static int snapshot_at(struct vm *vm, struct code *code, int line, const char *filename) {
+	/* A line without code stops at the next one with some. */
+	while ((size_t)line < code->size && code->jumps[line - 1] == code->jumps[line]) {
+		line++;
+	}
+	if ((size_t)line >= code->size) {
+		fprintf(stderr, "sem: no code at or after line %d\n", line);
+		return EXIT_FAILURE;
+	}
+
+	const size_t nwords = code->size / 64 + 1;
+	struct breakpoints bp = {.lines = xmalloc(nwords * sizeof(uint64_t))};
+	memset(bp.lines, 0, nwords * sizeof(uint64_t));
+	bp.lines[line / 64] |= UINT64_C(1) << (line % 64);
+	const int sts = eval_code_until(vm, code, &bp);
+	free(bp.lines);
+
+	if (sts == VM_BREAK) {
+		return vm_snapshot(vm, code, filename) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (sts < 0) {
+		return sts;
+	}
+	fprintf(stderr, "sem: the program ended before line %d\n", line);
+	return EXIT_FAILURE;
+}
+
 int main(const int argc, char *argv[]) {
 	size_t mem_size = DEFAULT_DATA_SIZE;
-	size_t stack_size = DEFAULT_STACK_SIZE;
+	size_t stack_size = 0; /* what the program needs */
 	int debugger = 0;
+	int optimize = 0;
+	int jit = 0;
+	int profile = 0;
+	int timed = 0;
+	int unbuffered = 0;
+	unsigned int memory_flags = 0;
+	const char *batch_dir = nullptr;
+	long jobs = 0;
+	int compile_only = 0;
+	int emit = 0;
+	int aot = 0;
+	int cache = 0;
+	const char *output = nullptr;
+	const char *flamegraph = nullptr;
+	const char *resume = nullptr;
+	const char *snapshot = nullptr;
+	int snapshot_line = 0;
+	uint64_t quantum = 0;
+	uint64_t fuel = 0;
+	uint64_t cpu_limit = 0; /* nanoseconds */
 	int opt = 0;
 	const struct option long_options[] = {
 		{"version", 0, nullptr, 'v'},
 		{"help", 0, nullptr, 'h'},
 		{"debug", 0, nullptr, 'd'},
+		{"optimize", 0, nullptr, 'O'},
+		{"jit", 0, nullptr, 'j'},
+		{"profile", 0, nullptr, 'p'},
+		{"profile-time", 0, nullptr, 'P'},
+		{"flamegraph", 1, nullptr, 'F'},
+		{"unbuffered", 0, nullptr, 'u'},
+		{"sparse", 0, nullptr, 'S'},
+		{"batch", 1, nullptr, 'b'},
+		{"jobs", 1, nullptr, 'J'},
+		{"huge-pages", 0, nullptr, 'H'},
+		{"compile", 0, nullptr, 'c'},
+		{"cache", 0, nullptr, 'C'},
+		{"output", 1, nullptr, 'o'},
+		{"emit-c", 0, nullptr, 'e'},
+		{"aot", 0, nullptr, 'a'},
+		{"resume", 1, nullptr, 'r'},
+		{"snapshot-at", 1, nullptr, 'T'},
+		{"quantum", 1, nullptr, 'q'},
+		{"fuel", 1, nullptr, 'f'},
+		{"cpu-limit", 1, nullptr, 't'},
 		{nullptr, 0, nullptr, 'm'},
 		{nullptr, 0, nullptr, 's'},
 
@@ -75,13 +169,13 @@ int main(const int argc, char *argv[]) {
 		{nullptr, 0, nullptr, 0}
 	};
 
-	while ((opt = getopt_long(argc, argv, "hm:s:vd", long_options, nullptr)) != EOF) {
+	while ((opt = getopt_long(argc, argv, "hm:s:vdjOpPF:ucCo:SHb:J:ear:T:q:f:t:", long_options, nullptr)) != EOF) {
 		switch (opt) {
 			case 'h':
 				usage(EXIT_SUCCESS);
 
 			case 'm':
-				if (sscanf(optarg, "%d", &mem_size) != 1 || mem_size > MAX_DATA_SIZE) {
+				if (sscanf(optarg, "%zu", &mem_size) != 1 || mem_size > MAX_DATA_SIZE) {
 					fprintf(stderr,
 							"sem: invalid memory size (%s)\n",
 							optarg);
@@ -90,7 +184,7 @@ int main(const int argc, char *argv[]) {
 				break;
 
 			case 's':
-				if (sscanf(optarg, "%d", &stack_size) != 1 || stack_size > MAX_STACK_SIZE) {
+				if (sscanf(optarg, "%zu", &stack_size) != 1 || stack_size < 1 || stack_size > MAX_STACK_SIZE) {
 					fprintf(stderr,
 					        "sem: invalid stack size (%s)\n",
 					        optarg);
@@ -102,6 +196,113 @@ int main(const int argc, char *argv[]) {
 				debugger = 1;
 				break;
 
+			case 'j':
+				jit = 1;
+				break;
+
+			case 'O':
+				optimize = 1;
+				break;
+
+			case 'P':
+				timed = 1;
+				profile = 1;
+				break;
+
+			case 'p':
+				profile = 1;
+				break;
+
+			case 'F':
+				flamegraph = optarg;
+				profile = 1;
+				break;
+
+			case 'u':
+				unbuffered = 1;
+				break;
+
+			case 'S':
+				memory_flags |= VM_SPARSE;
+				break;
+
+			case 'b':
+				batch_dir = optarg;
+				break;
+
+			case 'J':
+				jobs = strtol(optarg, nullptr, 10);
+				if (jobs < 1 || jobs > 1024) {
+					fprintf(stderr, "sem: invalid number of jobs (%s)\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'H':
+				memory_flags |= VM_HUGE_PAGES;
+				break;
+
+			case 'c':
+				compile_only = 1;
+				break;
+
+			case 'C':
+				cache = 1;
+				break;
+
+			case 'o':
+				output = optarg;
+				break;
+
+			case 'e':
+				emit = 1;
+				break;
+
+			case 'a':
+				aot = 1;
+				break;
+
+			case 'r':
+				resume = optarg;
+				break;
+
+			case 'T':
+				/* Two arguments: the line, then the file. */
+				if (sscanf(optarg, "%d", &snapshot_line) != 1 || snapshot_line < 1) {
+					fprintf(stderr, "sem: invalid line (%s)\n", optarg);
+					return EXIT_FAILURE;
+				}
+				if (optind >= argc) {
+					fprintf(stderr, "sem: -T needs a line and a file\n");
+					return EXIT_FAILURE;
+				}
+				snapshot = argv[optind++];
+				break;
+
+			case 'q':
+				if (sscanf(optarg, "%" SCNu64, &quantum) != 1 || quantum < 1) {
+					fprintf(stderr, "sem: invalid quantum (%s)\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'f':
+				if (sscanf(optarg, "%" SCNu64, &fuel) != 1 || fuel < 1) {
+					fprintf(stderr, "sem: invalid fuel (%s)\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 't': {
+				double seconds;
+				if (sscanf(optarg, "%lf", &seconds) != 1 || !(seconds > 0) || seconds > 1e9) {
+					fprintf(stderr, "sem: invalid CPU time (%s)\n", optarg);
+					return EXIT_FAILURE;
+				}
+				cpu_limit = (uint64_t)(seconds * 1e9);
+				break;
+			}
+
 			case 'v':
 				fprintf(stdout, "%s", license);
 				return EXIT_SUCCESS;
@@ -118,19 +319,136 @@ int main(const int argc, char *argv[]) {
 
 	int status;
 	const char *filename = argv[optind];
-	struct code *code = compile_code(filename);
+	const size_t len = strlen(filename);
+	struct code *code;
+
+	if (len > 5 && strcmp(filename + len - 5, ".semc") == 0) {
+		code = code_load(filename);
+	} else if (cache && !compile_only) {
+		code = compile_cached(filename, optimize);
+	} else {
+		code = compile_code(filename, optimize);
+	}
 
 	if (code == nullptr) {
 		// error message should be already displayed at this point
 		return EXIT_FAILURE;
 	}
-	struct vm *vm = vm_init(mem_size, stack_size);
-	if (debugger) {
+
+	/* The stack is sized by the compiler, up to -s. */
+	if (stack_size == 0) {
+		stack_size = code->depth > 0 ? code->depth : 1;
+	} else if (!compile_only && !emit && !aot && vm_check_stack(code, stack_size) < 0) {
+		code_destroy(code);
+		return EXIT_FAILURE;
+	}
+
+	if (compile_only) {
+		char *semc = nullptr;
+		if (output == nullptr) {
+			semc = xmalloc(len + 2);
+			memcpy(semc, filename, len);
+			memcpy(semc + len, "c", 2);
+		}
+		status = code_save(code, output != nullptr ? output : semc) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+		free(semc);
+		code_destroy(code);
+		return status;
+	}
+	if (emit) {
+		FILE *out = (output != nullptr) ? fopen(output, "w") : stdout;
+		if (out == nullptr) {
+			fprintf(stderr, "sem: cannot write '%s'\n", output);
+			status = EXIT_FAILURE;
+		} else {
+			status = emit_c(out, code, mem_size) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+			if (out != stdout && fclose(out) != 0) {
+				status = EXIT_FAILURE;
+			}
+		}
+		code_destroy(code);
+		return status;
+	}
+	if (aot) {
+		if (output == nullptr) {
+			fprintf(stderr, "sem: -a needs an output file (-o)\n");
+			status = EXIT_FAILURE;
+		} else {
+			status = emit_native(code, mem_size, output) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+		code_destroy(code);
+		return status;
+	}
+	/* Fuel, and so the limits and the turns, is for the interpreter alone. */
+	const int scheduled = quantum != 0 || fuel != 0 || cpu_limit != 0;
+	if (((resume != nullptr || snapshot != nullptr || scheduled) && (debugger || profile || jit))
+	    || (snapshot != nullptr && (batch_dir != nullptr || scheduled))) {
+		fprintf(stderr, "sem: -f, -q, -r, -t and -T cannot be used with -d, -j or -p, nor -T with -b, -f, -q or -t\n");
+		code_destroy(code);
+		return EXIT_FAILURE;
+	}
+	if (scheduled && quantum == 0) {
+		quantum = DEFAULT_QUANTUM;
+	}
+
+	/* A batch makes its own vms, unless they are forks of a snapshot. */
+	struct vm *vm = nullptr;
+	if (resume != nullptr) {
+		vm = vm_restore(code, resume, stack_size, memory_flags);
+		if (vm == nullptr) {
+			code_destroy(code);
+			return EXIT_FAILURE;
+		}
+		vm->out.unbuffered = unbuffered;
+	} else if (batch_dir == nullptr) {
+		vm = vm_init(mem_size, stack_size, memory_flags);
+		vm->out.unbuffered = unbuffered;
+	}
+
+	if (batch_dir != nullptr) {
+		const struct batch batch = {
+			.dir = batch_dir,
+			.jobs = (unsigned int)(jobs > 0 ? jobs : sysconf(_SC_NPROCESSORS_ONLN)),
+			.jit = jit,
+			.memsize = mem_size,
+			.stacksize = stack_size,
+			.memory_flags = memory_flags,
+			.start = (resume != nullptr) ? vm : nullptr,
+			.quantum = scheduled ? quantum : 0,
+			.fuel_limit = fuel,
+			.cpu_limit = cpu_limit,
+		};
+		status = run_batch(code, &batch) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	} else if (snapshot != nullptr) {
+		status = snapshot_at(vm, code, snapshot_line, snapshot);
+	} else if (scheduled) {
+		/* A single task, for its limits. */
+		struct task task = {.vm = vm, .code = code, .fuel_limit = fuel, .cpu_limit = cpu_limit};
+		struct scheduler *sched = sched_init(1, quantum, 1);
+		sched_submit(sched, &task);
+		sched_destroy(sched);
+		status = task.status;
+	} else if (resume != nullptr) {
+		status = eval_code_resume(vm, code);
+	} else if (debugger) {
 		status = debug_code(vm, code);
+	} else if (profile) {
+		struct profile *prof = profile_init(code, timed);
+		status = eval_code_profile(vm, code, prof);
+		fflush(stdout);
+		profile_report(stderr, code, prof);
+		if (flamegraph != nullptr && profile_write_collapsed(flamegraph, code, prof) < 0 && status == 0) {
+			status = EXIT_FAILURE;
+		}
+		profile_destroy(prof);
+	} else if (jit) {
+		status = eval_code_jit(vm, code);
 	} else {
 		status = eval_code(vm, code);
 	}
 	code_destroy(code);
-	vm_destroy(vm);
+	if (vm != nullptr) {
+		vm_destroy(vm);
+	}
 	return status;
 }
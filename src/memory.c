@@ -15,6 +15,17 @@ void *xmalloc(const size_t size)
 	return mem;
 }
 
+void *xrealloc(void *ptr, const size_t size)
+{
+	void *mem = realloc(ptr, size);
+
+	if (mem == nullptr) {
+		abort();
+	}
+
+	return mem;
+}
+
 char *xstrdup(const char *str)
 {
 	assert(str != nullptr);
@@ -22,6 +33,73 @@ char *xstrdup(const char *str)
 	return strcpy(dup, str);
 }
 
+enum {
+	ARENA_MIN_CHUNK = 4096,
+	ARENA_MAX_CHUNK = 1024 * 1024,
+};
+
+void arena_init(struct arena *a)
+{
+	a->chunks = nullptr;
+}
+
+/*
+ * Allocate size bytes, aligned for any type. A new chunk is twice the
+ * last one, up to ARENA_MAX_CHUNK, or as large as the allocation.
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+	const size_t align = alignof(max_align_t);
+	size = (size + align - 1) & ~(align - 1);
+
+	struct arena_chunk *c = a->chunks;
+	if (c == nullptr || c->size - c->used < size) {
+		size_t chunk = (c == nullptr) ? ARENA_MIN_CHUNK : 2 * c->size;
+		if (chunk > ARENA_MAX_CHUNK) {
+			chunk = ARENA_MAX_CHUNK;
+		}
+		if (chunk < size) {
+			chunk = size;
+		}
+		c = xmalloc(sizeof(struct arena_chunk) + chunk);
+		c->next = a->chunks;
+		c->size = chunk;
+		c->used = 0;
+		a->chunks = c;
+	}
+
+	void *mem = c->data + c->used;
+	c->used += size;
+	return mem;
+}
+
+char *arena_strdup(struct arena *a, const char *str)
+{
+	assert(str != nullptr);
+	const size_t size = strlen(str) + 1;
+	return memcpy(arena_alloc(a, size), str, size);
+}
+
+void arena_destroy(struct arena *a)
+{
+	struct arena_chunk *c = a->chunks;
+	while (c != nullptr) {
+		struct arena_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	a->chunks = nullptr;
+}
+
+uint64_t fnv1a(uint64_t h, const void *p, const size_t n)
+{
+	const unsigned char *s = p;
+	for (size_t i = 0; i < n; i++) {
+		h = (h ^ s[i]) * UINT64_C(0x100000001b3);
+	}
+	return h;
+}
+
 /* 
  * example:
  *   '"\\n"' -> '\n'
@@ -0,0 +1,601 @@
+/*
+ * optimize.c -- The optimizer
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "sem.h"
+
+const signed char opcode_pops[] = {
+#define X(op, pops, pushes) [op] = (pops),
+	OPCODES(X)
+#undef X
+};
+
+const signed char opcode_pushes[] = {
+#define X(op, pops, pushes) [op] = (pushes),
+	OPCODES(X)
+#undef X
+};
+
+/* Superinstructions for "INT k; op"; zero means none. */
+static const opcode_t immediate_forms[NOPCODES] = {
+	[MEM] = LOAD,
+	[ADD] = ADDI, [SUB] = SUBI, [MUL] = MULI, [DIV] = DIVI, [MOD] = MODI,
+	[EQ] = EQI, [NE] = NEI, [GT] = GTI, [LT] = LTI, [GE] = GEI, [LE] = LEI
+};
+
+/* Superinstructions for "op; JUMPT"; zero means none. */
+static const opcode_t branch_forms[NOPCODES] = {
+	[EQ] = JEQ, [NE] = JNE, [GT] = JGT, [LT] = JLT, [GE] = JGE, [LE] = JLE
+};
+
+/* Does op jump to the line in its argument? */
+int is_branch(opcode_t op)
+{
+	return op == GOTO || op == JEQ || op == JNE || op == JGT
+	    || op == JLT || op == JGE || op == JLE;
+}
+
+static int is_line(const struct code *code, int n)
+{
+	return n >= 1 && (size_t)n < code->size;
+}
+
+/*
+ * Is the leading INT of a statement used only by the opcode at body[end]?
+ * That holds when the opcodes in between never pop it.
+ */
+static int is_leading_operand(const struct instr *body, size_t end)
+{
+	if (end < 1 || body[0].opcode != INT) {
+		return 0;
+	}
+
+	int depth = 1;
+	for (size_t i = 1; i < end; i++) {
+		if (opcode_pops[body[i].opcode] > depth - 1) {
+			return 0;
+		}
+		depth += opcode_pushes[body[i].opcode] - opcode_pops[body[i].opcode];
+	}
+	return 1;
+}
+
+/*
+ * Rewrite one statement, that is the opcodes between two SETLINENO,
+ * into out. Returns the number of opcodes written, never more than n.
+ *
+ * The statement's shape is handled first: a literal target of set,
+ * jump or jumpt becomes the argument of STORE, GOTO or of a
+ * compare-and-branch. Jumps to a line that does not exist, which the
+ * folding of constants can produce, keep failing at runtime. Then
+ * "INT k; MEM" and "INT k; op" pairs are fused.
+ */
+static size_t peephole_stmt(const struct code *code, const struct instr *body, size_t n,
+			    struct instr *tmp, struct instr *out)
+{
+	size_t len = 0;
+	const opcode_t last = (n > 0) ? body[n - 1].opcode : HALT;
+
+	if (last == SET && is_leading_operand(body, n - 1)) {
+		memcpy(tmp, body + 1, (n - 2) * sizeof(struct instr));
+		len = n - 2;
+		tmp[len].opcode = STORE;
+		tmp[len++].intv = body[0].intv;
+	} else if (last == JUMP && n == 2 && body[0].opcode == INT && is_line(code, body[0].intv)) {
+		tmp[len].opcode = GOTO;
+		tmp[len++].intv = body[0].intv;
+	} else if (last == JUMPT && n >= 3 && branch_forms[body[n - 2].opcode]
+		   && is_leading_operand(body, n - 2) && is_line(code, body[0].intv)) {
+		memcpy(tmp, body + 1, (n - 3) * sizeof(struct instr));
+		len = n - 3;
+		tmp[len].opcode = branch_forms[body[n - 2].opcode];
+		tmp[len++].intv = body[0].intv;
+	} else {
+		memcpy(tmp, body, n * sizeof(struct instr));
+		len = n;
+	}
+
+	size_t w = 0;
+	for (size_t r = 0; r < len; r++) {
+		out[w] = tmp[r];
+		if (tmp[r].opcode == INT && r + 1 < len) {
+			const opcode_t fused = immediate_forms[tmp[r + 1].opcode];
+			/* Dividing by a literal zero keeps failing at runtime. */
+			const int by_zero = (fused == DIVI || fused == MODI) && tmp[r].intv == 0;
+			if (fused && !by_zero) {
+				out[w].opcode = fused;
+				r++;
+			}
+		}
+		w++;
+	}
+	return w;
+}
+
+/*
+ * Constant folding
+ * ================
+ *
+ * Each statement is rebuilt as a tree from its opcodes, which are in
+ * postfix order; constant subtrees are evaluated, then the tree is
+ * emitted again.
+ */
+struct node {
+	opcode_t opcode;
+	int intv;
+	struct node *left;
+	struct node *right;
+};
+
+static int is_const(const struct node *n)
+{
+	return n->opcode == INT;
+}
+
+/* Can evaluating n fail at runtime? Reading memory or dividing can. */
+static int may_fail(const struct node *n)
+{
+	if (n == NULL) {
+		return 0;
+	}
+	if (n->opcode == MEM || n->opcode == DIV || n->opcode == MOD) {
+		return 1;
+	}
+	return may_fail(n->left) || may_fail(n->right);
+}
+
+static struct node *make_const(struct node *n, int value)
+{
+	n->opcode = INT;
+	n->intv = value;
+	n->left = NULL;
+	n->right = NULL;
+	return n;
+}
+
+/* Evaluate p op q as the interpreter does; returns 0 if it cannot. */
+static int eval_binary(opcode_t op, int p, int q, int *result)
+{
+	/* Signed overflow wraps around in the interpreter too. */
+	const unsigned int up = (unsigned int)p;
+	const unsigned int uq = (unsigned int)q;
+
+	if (op == ADD) {
+		*result = (int)(up + uq);
+	} else if (op == SUB) {
+		*result = (int)(up - uq);
+	} else if (op == MUL) {
+		*result = (int)(up * uq);
+	} else if (op == DIV || op == MOD) {
+		/* Left to the runtime, which reports or traps them. */
+		if (q == 0 || (p == INT_MIN && q == -1)) {
+			return 0;
+		}
+		*result = (op == DIV) ? p / q : p % q;
+	} else if (op == EQ) {
+		*result = p == q;
+	} else if (op == NE) {
+		*result = p != q;
+	} else if (op == GT) {
+		*result = p > q;
+	} else if (op == LT) {
+		*result = p < q;
+	} else if (op == GE) {
+		*result = p >= q;
+	} else if (op == LE) {
+		*result = p <= q;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/* Fold an expression, returning the simplified tree. */
+static struct node *fold(struct node *n)
+{
+	if (n->left != NULL) {
+		n->left = fold(n->left);
+	}
+	if (n->right != NULL) {
+		n->right = fold(n->right);
+	}
+
+	if (n->left == NULL || n->right == NULL) {
+		return n;
+	}
+
+	struct node *l = n->left;
+	struct node *r = n->right;
+	int value;
+
+	if (is_const(l) && is_const(r) && eval_binary(n->opcode, l->intv, r->intv, &value)) {
+		return make_const(n, value);
+	}
+
+	/* Algebraic identities. */
+	const int lzero = is_const(l) && l->intv == 0;
+	const int rzero = is_const(r) && r->intv == 0;
+	const int lone = is_const(l) && l->intv == 1;
+	const int rone = is_const(r) && r->intv == 1;
+
+	if (n->opcode == ADD && rzero) {	/* x + 0 */
+		return l;
+	}
+	if (n->opcode == ADD && lzero) {	/* 0 + x */
+		return r;
+	}
+	if (n->opcode == SUB && rzero) {	/* x - 0 */
+		return l;
+	}
+	if ((n->opcode == MUL || n->opcode == DIV) && rone) {	/* x * 1, x / 1 */
+		return l;
+	}
+	if (n->opcode == MUL && lone) {	/* 1 * x */
+		return r;
+	}
+	if (n->opcode == MUL && ((rzero && !may_fail(l)) || (lzero && !may_fail(r)))) {
+		return make_const(n, 0);	/* x * 0, 0 * x */
+	}
+	if (n->opcode == MOD && rone && !may_fail(l)) {	/* x % 1 */
+		return make_const(n, 0);
+	}
+
+	return n;
+}
+
+static size_t emit_tree(const struct node *n, struct instr *out)
+{
+	size_t len = 0;
+
+	if (n->left != NULL) {
+		len += emit_tree(n->left, out + len);
+	}
+	if (n->right != NULL) {
+		len += emit_tree(n->right, out + len);
+	}
+	out[len].opcode = n->opcode;
+	out[len].intv = n->intv;
+	return len + 1;
+}
+
+/*
+ * Fold one statement of line lineno into out, returning the number of
+ * opcodes written (never more than n).
+ */
+static size_t fold_stmt(const struct code *code, int lineno, const struct instr *body,
+			size_t n, struct node *nodes, struct node **stack, struct instr *out)
+{
+	size_t top = 0;
+	size_t len = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		struct node *node = &nodes[i];
+		node->opcode = body[i].opcode;
+		node->intv = body[i].intv;
+		node->left = NULL;
+		node->right = NULL;
+
+		/* ip is the line after this one. */
+		if (node->opcode == IP) {
+			make_const(node, lineno + 1);
+		}
+
+		if (opcode_pops[node->opcode] == 2) {
+			node->right = stack[--top];
+			node->left = stack[--top];
+		} else if (opcode_pops[node->opcode] == 1) {
+			node->left = stack[--top];
+		}
+
+		if (opcode_pushes[node->opcode] == 1) {
+			stack[top++] = node;
+			continue;
+		}
+
+		/* A statement: fold its operands, then emit it. */
+		if (node->left != NULL) {
+			node->left = fold(node->left);
+		}
+		if (node->right != NULL) {
+			node->right = fold(node->right);
+		}
+
+		if (node->opcode == JUMPT && is_const(node->right) && is_const(node->left)
+		    && is_line(code, node->left->intv)) {
+			if (node->right->intv == 0) {
+				continue;	/* never taken */
+			}
+			node->opcode = JUMP;	/* always taken */
+			node->right = NULL;
+		}
+
+		len += emit_tree(node, out + len);
+	}
+
+	return len;
+}
+
+/*
+ * Constant folding. Evaluates at compile time the expressions whose
+ * operands are all literals, replaces ip with the line it refers to
+ * and simplifies x + 0, x * 1 and x * 0, for example:
+ *
+ *   set D[1], ip + 2 * 8 - 1
+ *
+ * at line 3 is compiled to INT 1; MEM; INT 19; SET. Expressions that
+ * fail at runtime, such as 1 / 0 or D[-1], are kept as they are.
+ */
+void fold_constants(struct code *code)
+{
+	struct instr *tmp = xmalloc(code->ninstrs * sizeof(struct instr));
+	struct node *nodes = xmalloc(code->ninstrs * sizeof(struct node));
+	struct node **stack = xmalloc(code->ninstrs * sizeof(struct node *));
+	size_t w = 0;
+	size_t r = 0;
+
+	while (r < code->ninstrs) {
+		const int lineno = code->instrs[r].intv;
+		code->instrs[w++] = code->instrs[r++];
+
+		size_t end = r;
+		while (end < code->ninstrs && code->instrs[end].opcode != SETLINENO) {
+			end++;
+		}
+		const size_t n = end - r;
+		memcpy(tmp, code->instrs + r, n * sizeof(struct instr));
+		w += fold_stmt(code, lineno, tmp, n, nodes, stack, code->instrs + w);
+		r = end;
+	}
+
+	code->ninstrs = w;
+	free(stack);
+	free(nodes);
+	free(tmp);
+}
+
+/*
+ * Peephole optimization. Replaces the common sequences emitted by the
+ * compiler with superinstructions, for example:
+ *
+ *   set 1, D[1] - 1
+ *
+ * is compiled to:
+ *
+ *   INT 1; INT 1; MEM; INT 1; SUB; SET
+ *
+ * and rewritten as:
+ *
+ *   LOAD 1; SUBI 1; STORE 1
+ *
+ * while "jump 9" becomes GOTO 9, instead of INT 9; JUMP.
+ *
+ * Lines are never merged, since any of them can be a jump target.
+ */
+void peephole(struct code *code)
+{
+	struct instr *tmp = xmalloc(code->ninstrs * sizeof(struct instr));
+	size_t w = 0;
+	size_t r = 0;
+
+	while (r < code->ninstrs) {
+		/* Copy the SETLINENO, then rewrite the statement after it. */
+		code->instrs[w++] = code->instrs[r++];
+
+		size_t end = r;
+		while (end < code->ninstrs && code->instrs[end].opcode != SETLINENO) {
+			end++;
+		}
+		w += peephole_stmt(code, code->instrs + r, end - r, tmp, code->instrs + w);
+		r = end;
+	}
+
+	code->ninstrs = w;
+	free(tmp);
+}
+
+/*
+ * Bounds of addresses
+ * ===================
+ *
+ * The values on the stack are tracked as intervals through each line,
+ * which starts with nothing known: literals, comparisons and remainders
+ * are bounded, memory and input are not. A computed address that cannot
+ * be negative turns MEM into MEMU and SET into SETU, whose argument is
+ * the largest address it can take. Literal addresses (LOAD and STORE)
+ * need nothing, as their argument is the address itself.
+ */
+struct range {
+	int64_t lo;
+	int64_t hi;
+};
+
+/* Set r to [lo, hi], or to any int if a result can wrap around. */
+static void set_range(struct range *r, int64_t lo, int64_t hi)
+{
+	if (lo < INT_MIN || hi > INT_MAX) {
+		lo = INT_MIN;
+		hi = INT_MAX;
+	}
+	r->lo = lo;
+	r->hi = hi;
+}
+
+static int64_t min4(int64_t a, int64_t b, int64_t c, int64_t d)
+{
+	const int64_t m = a < b ? a : b;
+	const int64_t n = c < d ? c : d;
+	return m < n ? m : n;
+}
+
+static int64_t max4(int64_t a, int64_t b, int64_t c, int64_t d)
+{
+	const int64_t m = a > b ? a : b;
+	const int64_t n = c > d ? c : d;
+	return m > n ? m : n;
+}
+
+/* Set r to the range of p op q, for p in a and q in b. */
+static void eval_range(opcode_t op, const struct range *a, const struct range *b, struct range *r)
+{
+	/* Dividing is monotonic in each operand while q keeps its sign. */
+	const int divides = b->lo > 0 || b->hi < 0;
+
+	if (op == ADD) {
+		set_range(r, a->lo + b->lo, a->hi + b->hi);
+	} else if (op == SUB) {
+		set_range(r, a->lo - b->hi, a->hi - b->lo);
+	} else if (op == MUL) {
+		set_range(r, min4(a->lo * b->lo, a->lo * b->hi, a->hi * b->lo, a->hi * b->hi),
+			  max4(a->lo * b->lo, a->lo * b->hi, a->hi * b->lo, a->hi * b->hi));
+	} else if (op == DIV && divides) {
+		set_range(r, min4(a->lo / b->lo, a->lo / b->hi, a->hi / b->lo, a->hi / b->hi),
+			  max4(a->lo / b->lo, a->lo / b->hi, a->hi / b->lo, a->hi / b->hi));
+	} else if (op == MOD && divides) {
+		/* |p % q| < |q|, and p % q has the sign of p. */
+		const int64_t m = (b->lo > 0 ? b->hi : -b->lo) - 1;
+		if (a->lo >= 0) {
+			set_range(r, 0, a->hi < m ? a->hi : m);
+		} else if (a->hi <= 0) {
+			set_range(r, a->lo > -m ? a->lo : -m, 0);
+		} else {
+			set_range(r, -m, m);
+		}
+	} else if (op == EQ || op == NE || op == GT || op == LT || op == GE || op == LE) {
+		set_range(r, 0, 1);
+	} else {
+		set_range(r, INT_MIN, INT_MAX);
+	}
+}
+
+/* The opcode that takes its operand from the stack, for "op k". */
+static const opcode_t stack_forms[NOPCODES] = {
+	[ADDI] = ADD, [SUBI] = SUB, [MULI] = MUL, [DIVI] = DIV, [MODI] = MOD,
+	[EQI] = EQ, [NEI] = NE, [GTI] = GT, [LTI] = LT, [GEI] = GE, [LEI] = LE
+};
+
+static void bound_line(struct instr *body, size_t n, struct range *stack)
+{
+	const struct range any = { INT_MIN, INT_MAX };
+	size_t top = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		struct instr *ip = &body[i];
+		const opcode_t op = ip->opcode;
+		const size_t pops = (size_t)opcode_pops[op];
+
+		/* Whatever was on the stack before the line is not known. */
+		const struct range q = (pops >= 1 && top >= 1) ? stack[top - 1] : any;
+		const struct range p = (pops >= 2 && top >= 2) ? stack[top - 2] : any;
+		top = (top >= pops) ? top - pops : 0;
+
+		if (op == MEM && q.lo >= 0) {
+			ip->opcode = MEMU;
+			ip->intv = (int)q.hi;
+		} else if (op == SET && p.lo >= 0) {
+			ip->opcode = SETU;
+			ip->intv = (int)p.hi;
+		}
+
+		if (opcode_pushes[op] == 0) {
+			continue;
+		}
+
+		struct range *r = &stack[top++];
+		const struct range k = { ip->intv, ip->intv };
+		if (op == INT || op == IP) {
+			*r = k;
+		} else if (pops == 2) {
+			eval_range(op, &p, &q, r);
+		} else if (stack_forms[op] && !((op == DIVI || op == MODI) && ip->intv == 0)) {
+			eval_range(stack_forms[op], &q, &k, r);
+		} else {
+			*r = any;
+		}
+	}
+}
+
+/*
+ * Prove, where it can, the addresses of MEM and SET in range. It runs
+ * on the final code, where lines start at code->jumps, and on code
+ * loaded from a bytecode file, whose bounds are not trusted: MEMU and
+ * SETU are taken back to MEM and SET first.
+ */
+void bound_addresses(struct code *code)
+{
+	struct range *stack = xmalloc((code->ninstrs + 1) * sizeof(struct range));
+
+	for (size_t i = 0; i < code->ninstrs; i++) {
+		if (code->instrs[i].opcode == MEMU) {
+			code->instrs[i].opcode = MEM;
+		} else if (code->instrs[i].opcode == SETU) {
+			code->instrs[i].opcode = SET;
+		}
+	}
+
+	for (size_t n = 0; n < code->size; n++) {
+		const size_t start = code->jumps[n];
+		const size_t end = (n + 1 < code->size) ? code->jumps[n + 1] : code->ninstrs;
+		bound_line(code->instrs + start, end - start, stack);
+	}
+
+	free(stack);
+}
+
+/*
+ * The stack each line needs, that is its deepest point, as the stack is
+ * empty between lines. Sets code->depth to the largest and code->depth_line
+ * to its line. Returns -1 if a line pops a value it did not push, or
+ * leaves one behind, which only a corrupt bytecode file can hold.
+ */
+int stack_depth(struct code *code)
+{
+	code->depth = 0;
+	code->depth_line = 0;
+
+	for (size_t n = 0; n < code->size; n++) {
+		const size_t start = code->jumps[n];
+		const size_t end = (n + 1 < code->size) ? code->jumps[n + 1] : code->ninstrs;
+		size_t depth = 0;
+		size_t max = 0;
+
+		for (size_t i = start; i < end; i++) {
+			const opcode_t op = code->instrs[i].opcode;
+			if ((size_t)opcode_pops[op] > depth) {
+				return -1;
+			}
+			depth += (size_t)opcode_pushes[op] - (size_t)opcode_pops[op];
+			if (depth > max) {
+				max = depth;
+			}
+		}
+		if (depth != 0) {
+			return -1;
+		}
+		if (max > code->depth) {
+			code->depth = max;
+			code->depth_line = (int)n + 1;
+		}
+	}
+	return 0;
+}
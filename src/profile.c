@@ -0,0 +1,237 @@
+/*
+ * profile.c -- The profiler
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sem.h"
+
+/* Number of opcode pairs in the report. */
+constexpr size_t TOP_PAIRS = 20;
+
+static const char *opstr[] = {
+#define X(op, pops, pushes) #op,
+	OPCODES(X)
+#undef X
+};
+
+struct profile *profile_init(const struct code *code, const int timed)
+{
+	struct profile *prof = xmalloc(sizeof(struct profile));
+	memset(prof, 0, sizeof(struct profile));
+	prof->timed = timed;
+	prof->hits = xmalloc(code->ninstrs * sizeof(uint64_t));
+	memset(prof->hits, 0, code->ninstrs * sizeof(uint64_t));
+	prof->ticks = xmalloc((code->size + 1) * sizeof(uint64_t));
+	memset(prof->ticks, 0, (code->size + 1) * sizeof(uint64_t));
+
+	/* An empty line starts where the next one does: count the latter. */
+	prof->line_at = xmalloc(code->ninstrs * sizeof(int));
+	memset(prof->line_at, 0, code->ninstrs * sizeof(int));
+	for (size_t n = 0; n < code->size; n++) {
+		if (code->jumps[n] < code->ninstrs) {
+			prof->line_at[code->jumps[n]] = (int)n + 1;
+		}
+	}
+	return prof;
+}
+
+void profile_destroy(struct profile *prof)
+{
+	free(prof->hits);
+	free(prof->ticks);
+	free(prof->line_at);
+	free(prof);
+}
+
+/* Executions of line n, that is of its first opcode; 0 if it is empty. */
+static uint64_t line_hits(const struct code *code, const struct profile *prof, size_t n)
+{
+	const size_t pc = code->jumps[n - 1];
+
+	if (pc >= code->ninstrs || (size_t)prof->line_at[pc] != n) {
+		return 0;
+	}
+	return prof->hits[pc];
+}
+
+/* Copy a source line without its newline. */
+static void chomp(char *line)
+{
+	line[strcspn(line, "\r\n")] = '\0';
+}
+
+static int by_count(const void *p, const void *q)
+{
+	const uint64_t a = **(const uint64_t *const *)p;
+	const uint64_t b = **(const uint64_t *const *)q;
+	return (a < b) - (a > b);
+}
+
+/*
+ * Print the source next to the executions of every line and, if
+ * timed, the time spent in it; then the executions of every opcode
+ * and the most frequent pairs of opcodes.
+ */
+void profile_report(FILE *out, const struct code *code, const struct profile *prof)
+{
+	uint64_t total = 0;
+	for (size_t n = 0; n <= code->size; n++) {
+		total += prof->ticks[n];
+	}
+
+	fprintf(out, "\nprofile of %s:\n\n", code->filename);
+	if (prof->timed) {
+		fprintf(out, "%12s %14s %6s %5s  %s\n", "hits", "ticks", "time", "line", "source");
+	} else {
+		fprintf(out, "%12s %5s  %s\n", "hits", "line", "source");
+	}
+
+	FILE *fp = fopen(code->filename, "r");
+	char line[1000];
+	for (size_t n = 1; n < code->size; n++) {
+		if (fp == NULL || fgets(line, sizeof(line), fp) == NULL) {
+			line[0] = '\0';
+		}
+		chomp(line);
+
+		const uint64_t hits = line_hits(code, prof, n);
+		if (prof->timed) {
+			const double pct = total ? 100.0 * (double)prof->ticks[n] / (double)total : 0.0;
+			fprintf(out, "%12llu %14llu %5.1f%% %5zu  %s\n", (unsigned long long)hits,
+				(unsigned long long)prof->ticks[n], pct, n, line);
+		} else {
+			fprintf(out, "%12llu %5zu  %s\n", (unsigned long long)hits, n, line);
+		}
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+
+	/* Opcodes, the most executed first. */
+	const uint64_t *ops[NOPCODES];
+	for (size_t i = 0; i < NOPCODES; i++) {
+		ops[i] = &prof->opcodes[i];
+	}
+	qsort(ops, NOPCODES, sizeof(ops[0]), by_count);
+
+	fprintf(out, "\n%12s  %s\n", "executions", "opcode");
+	for (size_t i = 0; i < NOPCODES && *ops[i] != 0; i++) {
+		fprintf(out, "%12llu  %s\n", (unsigned long long)*ops[i], opstr[ops[i] - prof->opcodes]);
+	}
+
+	/* The same for pairs, as indices into the flattened table. */
+	const uint64_t *pairs[NOPCODES * NOPCODES];
+	for (size_t i = 0; i < NOPCODES * NOPCODES; i++) {
+		pairs[i] = &prof->pairs[0][0] + i;
+	}
+	qsort(pairs, NOPCODES * NOPCODES, sizeof(pairs[0]), by_count);
+
+	fprintf(out, "\n%12s  %s\n", "executions", "pair");
+	for (size_t i = 0; i < TOP_PAIRS && *pairs[i] != 0; i++) {
+		const size_t k = (size_t)(pairs[i] - &prof->pairs[0][0]);
+		fprintf(out, "%12llu  %s %s\n", (unsigned long long)*pairs[i],
+			opstr[k / NOPCODES], opstr[k % NOPCODES]);
+	}
+}
+
+/*
+ * A frame name cannot contain ';', which separates the frames; blanks
+ * are squeezed to a single space, as the count follows the last one.
+ */
+static void frame_name(char *name)
+{
+	char *w = name;
+
+	for (const char *r = name; *r != '\0'; r++) {
+		const char c = (*r == ';') ? ',' : (*r == '\t') ? ' ' : *r;
+		if (c == ' ' && (w == name || w[-1] == ' ')) {
+			continue;
+		}
+		*w++ = c;
+	}
+	while (w > name && w[-1] == ' ') {
+		w--;
+	}
+	*w = '\0';
+}
+
+/*
+ * Write the profile in the collapsed stack format of flamegraph.pl,
+ * one line per stack:
+ *
+ *   fact.sem;7: set 2, D[2] * D[1];MULI 12
+ *
+ * The frames are the program, the line and the opcode, weighted by
+ * executions; if timed, the frames are the program and the line,
+ * weighted by ticks. Returns -1 if the file cannot be written.
+ */
+int profile_write_collapsed(const char *filename, const struct code *code, const struct profile *prof)
+{
+	FILE *out = fopen(filename, "w");
+	if (out == NULL) {
+		fprintf(stderr, "sem: cannot write '%s'\n", filename);
+		return -1;
+	}
+
+	char program[1000];
+	snprintf(program, sizeof(program), "%s", code->filename);
+	frame_name(program);
+
+	FILE *fp = fopen(code->filename, "r");
+	char line[1000];
+	for (size_t n = 1; n < code->size; n++) {
+		if (fp == NULL || fgets(line, sizeof(line), fp) == NULL) {
+			line[0] = '\0';
+		}
+		chomp(line);
+		frame_name(line);
+
+		if (prof->timed) {
+			if (prof->ticks[n] != 0) {
+				fprintf(out, "%s;%zu: %s %llu\n", program, n, line,
+					(unsigned long long)prof->ticks[n]);
+			}
+			continue;
+		}
+
+		/* The opcodes of line n, unless it is empty. */
+		if (line_hits(code, prof, n) == 0) {
+			continue;
+		}
+		const size_t end = (n < code->size) ? code->jumps[n] : code->ninstrs;
+		for (size_t pc = code->jumps[n - 1]; pc < end; pc++) {
+			if (prof->hits[pc] != 0) {
+				fprintf(out, "%s;%zu: %s;%s %llu\n", program, n, line,
+					opstr[code->instrs[pc].opcode], (unsigned long long)prof->hits[pc]);
+			}
+		}
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+
+	if (fclose(out) != 0) {
+		fprintf(stderr, "sem: cannot write '%s'\n", filename);
+		return -1;
+	}
+	return 0;
+}
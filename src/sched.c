@@ -0,0 +1,235 @@
+/*
+ * sched.c -- The scheduler
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * Runs many programs at once over a few worker threads, a slice at a
+ * time: a task (a vm and its code) runs on a quantum of fuel (see
+ * eval_code_fuel()), then goes to the back of the run queue, so that a
+ * program looping forever takes its turn with the others, and no more.
+ *
+ * At most max_active tasks are started at once; the others wait to be
+ * admitted, in order, so that what the started ones hold (their vms,
+ * their files) stays bounded however many are submitted.
+ *
+ * A task is accounted the fuel it burnt and the CPU time of the slices
+ * it ran; going over a limit of either stops it, as a runtime error.
+ * The code is threaded once per task, in its vm, so a slice costs
+ * about the opcodes it runs; but a program waiting for its input
+ * keeps its worker waiting too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include "sem.h"
+
+/* A queue of tasks, through their next. */
+struct task_queue {
+	struct task *head;
+	struct task *tail;
+};
+
+struct scheduler {
+	pthread_mutex_t lock;
+	pthread_cond_t wake; /* a task to run, a place free, or stopping */
+	struct task_queue ready; /* started, in turn */
+	struct task_queue pending; /* not started yet */
+	size_t active; /* started and not done */
+	size_t max_active;
+	uint64_t quantum;
+	int stopping;
+	pthread_t *threads;
+	unsigned int nthreads;
+};
+
+static void push(struct task_queue *q, struct task *t)
+{
+	t->next = NULL;
+	if (q->tail != NULL) {
+		q->tail->next = t;
+	} else {
+		q->head = t;
+	}
+	q->tail = t;
+}
+
+static struct task *pop(struct task_queue *q)
+{
+	struct task *t = q->head;
+	if (t != NULL) {
+		q->head = t->next;
+		if (q->head == NULL) {
+			q->tail = NULL;
+		}
+	}
+	return t;
+}
+
+static uint64_t cpu_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Run a slice of a task. Returns 1 once it is done. */
+static int run_slice(const struct scheduler *s, struct task *t)
+{
+	uint64_t quantum = s->quantum;
+	if (t->fuel_limit != 0 && t->fuel_limit - t->fuel_used < quantum) {
+		quantum = t->fuel_limit - t->fuel_used;
+	}
+
+	int64_t fuel = (int64_t)quantum;
+	const uint64_t start = cpu_now();
+	const int sts = eval_code_fuel(t->vm, t->code, &fuel);
+	t->cpu_used += cpu_now() - start;
+	t->fuel_used += (uint64_t)((int64_t)quantum - fuel);
+	t->slices++;
+
+	if (sts != VM_YIELD) {
+		t->status = (sts < 0) ? sts : 0;
+		return 1;
+	}
+
+	struct vm *vm = t->vm;
+	const int line = code_lineno(t->code, vm->ip);
+	if (t->fuel_limit != 0 && t->fuel_used >= t->fuel_limit) {
+		vm_error(vm, line, vm->stacktop, "out of fuel, after %" PRIu64 " opcodes", t->fuel_used);
+	} else if (t->cpu_limit != 0 && t->cpu_used >= t->cpu_limit) {
+		vm_error(vm, line, vm->stacktop, "out of time, after %.3f s of CPU", (double)t->cpu_used / 1e9);
+	} else {
+		return 0;
+	}
+	t->status = -1;
+	return 1;
+}
+
+static void *work(void *arg)
+{
+	struct scheduler *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		/* Start a task if there is room, otherwise take the next turn. */
+		struct task *t = NULL;
+		int fresh = 0;
+		if (s->active < s->max_active && (t = pop(&s->pending)) != NULL) {
+			s->active++;
+			fresh = 1;
+		} else {
+			t = pop(&s->ready);
+		}
+		if (t == NULL) {
+			if (s->stopping && s->active == 0 && s->pending.head == NULL) {
+				break;
+			}
+			pthread_cond_wait(&s->wake, &s->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		int done;
+		if (fresh && t->start != NULL && t->start(t) < 0) {
+			t->status = -1;
+			done = 1;
+		} else {
+			done = run_slice(s, t);
+		}
+		if (done && t->finish != NULL) {
+			t->finish(t);
+		}
+
+		pthread_mutex_lock(&s->lock);
+		if (done) {
+			s->active--;
+			pthread_cond_broadcast(&s->wake);
+		} else {
+			push(&s->ready, t);
+			pthread_cond_signal(&s->wake);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/*
+ * Start the workers, running slices of quantum opcodes, for at most
+ * max_active tasks at once. Exits if a thread cannot be created.
+ */
+struct scheduler *sched_init(const unsigned int workers, const uint64_t quantum, const size_t max_active)
+{
+	struct scheduler *s = xmalloc(sizeof(struct scheduler));
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->wake, NULL);
+	s->ready.head = s->ready.tail = NULL;
+	s->pending.head = s->pending.tail = NULL;
+	s->active = 0;
+	s->max_active = max_active > 0 ? max_active : 1;
+	s->quantum = quantum;
+	s->stopping = 0;
+	s->nthreads = workers > 0 ? workers : 1;
+	s->threads = xmalloc(s->nthreads * sizeof(pthread_t));
+	for (unsigned int i = 0; i < s->nthreads; i++) {
+		if (pthread_create(&s->threads[i], NULL, work, s) != 0) {
+			fprintf(stderr, "sem: cannot create a thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return s;
+}
+
+/*
+ * Add a task, to be started after those submitted before it, zeroing
+ * its accounting. The task, its vm and its code stay the caller's, not
+ * to be touched until it is done (see finish).
+ */
+void sched_submit(struct scheduler *s, struct task *t)
+{
+	t->fuel_used = 0;
+	t->cpu_used = 0;
+	t->slices = 0;
+	t->status = 0;
+
+	pthread_mutex_lock(&s->lock);
+	push(&s->pending, t);
+	pthread_cond_signal(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Wait for every task submitted to be done, then stop the workers. */
+void sched_destroy(struct scheduler *s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->stopping = 1;
+	pthread_cond_broadcast(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+
+	for (unsigned int i = 0; i < s->nthreads; i++) {
+		pthread_join(s->threads[i], NULL);
+	}
+	pthread_cond_destroy(&s->wake);
+	pthread_mutex_destroy(&s->lock);
+	free(s->threads);
+	free(s);
+}
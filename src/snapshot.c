@@ -0,0 +1,300 @@
+/*
+ * snapshot.c -- The snapshots of the vm
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * A snapshot (--snapshot-at, --resume) is the state of a vm, so that a
+ * run can go on from it later, as many times as needed:
+ *
+ *   header
+ *   pages     for each page of the memory that is not all zeroes, its
+ *             number (uint64_t) and its cells; then UINT64_MAX
+ *   stack     depth ints, from the bottom
+ *
+ * The ip is an index into the code, so the header records the code by
+ * its hash: a snapshot resumes only the program, compiled the same way,
+ * that took it. As for .semc files, the byte order is recorded too.
+ *
+ * Within a process, vm_fork() goes on from a state without a file, nor
+ * copying a large memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sem.h"
+
+enum { SNAPSHOT_VERSION = 1 };
+
+static const char snapshot_magic[8] = "SEMS\r\n\032\n";
+
+constexpr uint64_t END_OF_PAGES = UINT64_MAX;
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order; /* 0x01020304, as written */
+	uint64_t code; /* code_hash() */
+	uint64_t memsize;
+	uint64_t depth; /* of the stack */
+	uint64_t ip;
+	int64_t lineno; /* of ip */
+};
+
+/* FNV-1a of the opcodes, the lines, the loops and the strings of the code. */
+uint64_t code_hash(const struct code *code)
+{
+	uint64_t h = FNV1A_SEED;
+	h = fnv1a(h, code->instrs, code->ninstrs * sizeof(struct instr));
+	h = fnv1a(h, code->jumps, code->size * sizeof(size_t));
+	h = fnv1a(h, code->loops, code->nloops * sizeof(struct loop));
+	h = fnv1a(h, code->strings, code->strings_size);
+	return h;
+}
+
+/* Write the state of the vm to a file. Returns -1, after reporting it, if it cannot. */
+int vm_snapshot(const struct vm *vm, const struct code *code, const char *filename)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "sem: cannot write '%s'\n", filename);
+		return -1;
+	}
+
+	struct snapshot_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.byte_order = 0x01020304;
+	h.code = code_hash(code);
+	h.memsize = vm->memsize;
+	h.depth = (uint64_t)(vm->stacktop - vm->stack);
+	h.ip = vm->ip;
+	h.lineno = code_lineno(code, vm->ip);
+	fwrite(&h, sizeof(h), 1, fp);
+
+	const size_t npages = (vm->memsize + VM_PAGE_CELLS - 1) / VM_PAGE_CELLS;
+	for (size_t n = 0; n < npages; n++) {
+		size_t ncells;
+		const int *cells = vm_cells(vm, n, &ncells);
+		if (cells != NULL) {
+			const uint64_t page = n;
+			fwrite(&page, sizeof(page), 1, fp);
+			fwrite(cells, sizeof(int), ncells, fp);
+		}
+	}
+	fwrite(&END_OF_PAGES, sizeof(END_OF_PAGES), 1, fp);
+	fwrite(vm->stack, sizeof(int), (size_t)h.depth, fp);
+
+	if (ferror(fp) | fclose(fp)) {
+		fprintf(stderr, "sem: cannot write '%s'\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+static int read_pages(struct vm *vm, FILE *fp)
+{
+	const size_t npages = (vm->memsize + VM_PAGE_CELLS - 1) / VM_PAGE_CELLS;
+	uint64_t page;
+	while (fread(&page, sizeof(page), 1, fp) == 1) {
+		if (page == END_OF_PAGES) {
+			return 0;
+		}
+		if (page >= npages) {
+			return -1;
+		}
+		const size_t first = (size_t)page * VM_PAGE_CELLS;
+		const size_t ncells = (vm->memsize - first < VM_PAGE_CELLS) ? vm->memsize - first : VM_PAGE_CELLS;
+		int *cells = (vm->mem != NULL) ? vm->mem + first : vm_page(vm, (size_t)page);
+		if (fread(cells, sizeof(int), ncells, fp) != ncells) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/*
+ * A vm in the state written to a file by vm_snapshot(), for the code,
+ * to run on with eval_code_resume(). Its memory is as large as it was,
+ * made as vm_init() with flags does; its stack at least stacksize.
+ * Returns NULL, after reporting it, if the file cannot be read or is
+ * not a snapshot of the code.
+ */
+struct vm *vm_restore(const struct code *code, const char *filename, size_t stacksize, const unsigned int flags)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "sem: cannot read '%s'\n", filename);
+		return NULL;
+	}
+
+	struct snapshot_header h;
+	if (fread(&h, sizeof(h), 1, fp) != 1
+	    || memcmp(h.magic, snapshot_magic, sizeof(h.magic)) != 0
+	    || h.version != SNAPSHOT_VERSION || h.byte_order != 0x01020304) {
+		fprintf(stderr, "sem: '%s' is not a snapshot\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+	if (h.code != code_hash(code)) {
+		fprintf(stderr, "sem: '%s' is a snapshot of another program\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+	if (h.memsize > (uint64_t)INT_MAX + 1 || h.ip >= code->ninstrs
+	    || h.lineno != code_lineno(code, (size_t)h.ip) || h.depth > code->depth) {
+		fprintf(stderr, "sem: invalid snapshot '%s'\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	const size_t depth = (size_t)h.depth;
+	struct vm *vm = vm_init((size_t)h.memsize, stacksize > depth ? stacksize : depth, flags);
+	if (read_pages(vm, fp) < 0 || fread(vm->stack, sizeof(int), depth, fp) != depth) {
+		fprintf(stderr, "sem: invalid snapshot '%s'\n", filename);
+		fclose(fp);
+		vm_destroy(vm);
+		return NULL;
+	}
+	fclose(fp);
+	vm->stacktop = vm->stack + depth;
+	vm->ip = (size_t)h.ip;
+	return vm;
+}
+
+/*
+ * Move a mapped memory to an image, a shared memory object that the
+ * forks map privately, and so does the vm: the kernel copies a page
+ * only for whoever writes it first. Pages of zeroes are left as holes.
+ * vm_fork() does it if needed; once it is done, or if the memory is not
+ * mapped, forking only reads the vm, and threads may fork it at once.
+ * Returns -1 if the image cannot be made, leaving the memory as it was.
+ */
+int vm_share(struct vm *vm)
+{
+	if (vm->mapsize == 0 || vm->image >= 0) {
+		return 0;
+	}
+	if (vm->image == -2) {
+		return -1;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "/sem-%ld-%p", (long)getpid(), (void *)vm);
+	const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		vm->image = -2;
+		return -1;
+	}
+	shm_unlink(name);
+
+	int err = ftruncate(fd, (off_t)vm->mapsize);
+	const size_t npages = (vm->memsize + VM_PAGE_CELLS - 1) / VM_PAGE_CELLS;
+	for (size_t n = 0; n < npages && err == 0; n++) {
+		size_t ncells;
+		const int *cells = vm_cells(vm, n, &ncells);
+		const size_t size = ncells * sizeof(int);
+		if (cells != NULL && pwrite(fd, cells, size, (off_t)(n * VM_PAGE_CELLS * sizeof(int))) != (ssize_t)size) {
+			err = -1;
+		}
+	}
+	if (err == 0 && mmap(vm->mem, vm->mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		err = -1;
+	}
+	if (err != 0) {
+		close(fd);
+		vm->image = -2;
+		return -1;
+	}
+	vm->image = fd;
+	vm->cow = 1;
+	return 0;
+}
+
+/*
+ * A copy of the vm, memory, stack and ip, to run on from where it is
+ * with eval_code_resume(); its streams are those of the vm, unread and
+ * unwritten. A mapped memory is not copied but shared copy-on-write
+ * (see vm_share()), and stays shared with the next forks as long
+ * as the vm does not run: forking a warmed up vm many times costs a
+ * copy of its memory once. A small or sparse memory is copied.
+ */
+struct vm *vm_fork(struct vm *vm)
+{
+	struct vm *fork = (struct vm *) xmalloc(sizeof(struct vm));
+	fork->memsize = vm->memsize;
+	fork->mem = NULL;
+	fork->mapsize = 0;
+	fork->pages = NULL;
+	fork->image = -1;
+	fork->cow = 0;
+	if (vm->pages != NULL) {
+		const size_t ntables = vm->memsize / VM_PAGE_CELLS / VM_TABLE_PAGES + 1;
+		fork->pages = xmalloc(ntables * sizeof(int **));
+		memset(fork->pages, 0, ntables * sizeof(int **));
+		const size_t npages = (vm->memsize + VM_PAGE_CELLS - 1) / VM_PAGE_CELLS;
+		for (size_t n = 0; n < npages; n++) {
+			size_t ncells;
+			const int *cells = vm_cells(vm, n, &ncells);
+			if (cells != NULL) {
+				memcpy(vm_page(fork, n), cells, ncells * sizeof(int));
+			}
+		}
+	} else if (vm->mapsize != 0 && vm_share(vm) == 0
+	           && (fork->mem = mmap(NULL, vm->mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, vm->image, 0)) != MAP_FAILED) {
+		fork->mapsize = vm->mapsize;
+		fork->cow = 1;
+	} else {
+		fork->mem = xmalloc(sizeof(int) * vm->memsize);
+		memcpy(fork->mem, vm->mem, sizeof(int) * vm->memsize);
+	}
+
+	const size_t depth = (size_t)(vm->stacktop - vm->stack);
+	fork->stacksize = vm->stacksize;
+	fork->stack = xmalloc(sizeof(int) * vm->stacksize);
+	memcpy(fork->stack, vm->stack, sizeof(int) * vm->stacksize);
+	fork->stacktop = fork->stack + depth;
+	fork->ip = vm->ip;
+	reader_init(&fork->in, vm->in.fd);
+	writer_init(&fork->out, vm->out.fd);
+	fork->out.unbuffered = vm->out.unbuffered;
+	fork->err = vm->err;
+	fork->thread = NULL;
+	fork->thread_code = 0;
+	fork->thread_engine = NULL;
+	return fork;
+}
+
+/*
+ * Stop sharing the memory with later forks, as the vm is about to
+ * change it; the forks already made keep the image.
+ */
+void vm_unshare(struct vm *vm)
+{
+	if (vm->image >= 0) {
+		close(vm->image);
+		vm->image = -1;
+	}
+}
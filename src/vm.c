@@ -21,35 +21,317 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
-#include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "sem.h"
 
-struct vm *vm_init(const size_t memsize, const size_t stacksize) {
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* A memory of at least this many bytes is mapped. */
+constexpr size_t MAPPED_MEMORY = 64 * 1024;
+
+/*
+ * Map the data memory: the kernel hands out zeroed pages as they are
+ * first touched. Returns -1 if it cannot be reserved.
+ */
+static int map_memory(struct vm *vm, const unsigned int flags) {
+	const size_t size = vm->memsize * sizeof(int);
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		return -1;
+	}
+#ifdef MADV_HUGEPAGE
+	if (flags & VM_HUGE_PAGES) {
+		madvise(mem, size, MADV_HUGEPAGE);
+	}
+#endif
+	vm->mem = mem;
+	vm->mapsize = size;
+	return 0;
+}
+
+struct vm *vm_init(const size_t memsize, const size_t stacksize, const unsigned int flags) {
 	struct vm *vm = (struct vm *) xmalloc(sizeof(struct vm));
-	// memory
+	// memory: allocated, mapped or, if it cannot be mapped, sparse
 	vm->memsize = memsize;
-	vm->mem = xmalloc(sizeof(int) * memsize);
-	memset(vm->mem, 0, sizeof(int) * memsize);
+	vm->mem = NULL;
+	vm->mapsize = 0;
+	vm->pages = NULL;
+	vm->image = -1;
+	vm->cow = 0;
+	if (!(flags & VM_SPARSE) && memsize * sizeof(int) < MAPPED_MEMORY && !(flags & VM_HUGE_PAGES)) {
+		vm->mem = xmalloc(sizeof(int) * memsize);
+		memset(vm->mem, 0, sizeof(int) * memsize);
+	} else if ((flags & VM_SPARSE) || map_memory(vm, flags) < 0) {
+		const size_t ntables = memsize / VM_PAGE_CELLS / VM_TABLE_PAGES + 1;
+		vm->pages = xmalloc(ntables * sizeof(int **));
+		memset(vm->pages, 0, ntables * sizeof(int **));
+	}
 	// stack
 	vm->stacksize = stacksize;
 	vm->stack = xmalloc(sizeof(int) * stacksize);
 	memset(vm->stack, 0, sizeof(int) * stacksize);
 	vm->stacktop = vm->stack;
 	// ip
-	vm->ip = nullptr;
-	vm->lineno = 1;
+	vm->ip = 0;
+	// input, output and errors: the standard streams, unless changed
+	reader_init(&vm->in, fileno(stdin));
+	writer_init(&vm->out, fileno(stdout));
+	vm->err = stderr;
+	vm->thread = NULL;
+	vm->thread_code = 0;
+	vm->thread_engine = NULL;
 	return vm;
 }
 
+/* Free the pages of a sparse memory, which reads as zeroes again. */
+static void free_pages(struct vm *vm) {
+	const size_t ntables = vm->memsize / VM_PAGE_CELLS / VM_TABLE_PAGES + 1;
+	for (size_t t = 0; t < ntables; t++) {
+		if (vm->pages[t] == NULL) {
+			continue;
+		}
+		for (size_t n = 0; n < VM_TABLE_PAGES; n++) {
+			free(vm->pages[t][n]);
+		}
+		free(vm->pages[t]);
+		vm->pages[t] = NULL;
+	}
+}
+
+/*
+ * Make the vm as new, for running another program or the same one
+ * again: the memory is zeroed, dropping the pages of a mapped or sparse
+ * one, and the stack emptied. The streams are left alone, and so is
+ * the threaded code.
+ */
+void vm_reset(struct vm *vm) {
+	vm_unshare(vm);
+	if (vm->pages != NULL) {
+		free_pages(vm);
+	} else if (vm->cow) {
+		/* Dropping the pages would show the image again. */
+		if (mmap(vm->mem, vm->mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+			memset(vm->mem, 0, sizeof(int) * vm->memsize);
+		} else {
+			vm->cow = 0;
+		}
+	} else if (vm->mapsize == 0 || madvise(vm->mem, vm->mapsize, MADV_DONTNEED) < 0) {
+		memset(vm->mem, 0, sizeof(int) * vm->memsize);
+	}
+	vm->stacktop = vm->stack;
+	vm->ip = 0;
+}
+
 void vm_destroy(struct vm *vm) {
 	assert(vm != NULL);
-	free(vm->mem);
+	writer_flush(&vm->out);
+	reader_destroy(&vm->in);
+	vm_unshare(vm);
+	if (vm->pages != NULL) {
+		free_pages(vm);
+		free(vm->pages);
+	} else if (vm->mapsize != 0) {
+		munmap(vm->mem, vm->mapsize);
+	} else {
+		free(vm->mem);
+	}
 	free(vm->stack);
+	free(vm->thread);
 	free(vm);
 }
 
+/* Page n of a sparse memory, allocated, with its table, if it was never written. */
+int *vm_page(struct vm *vm, const size_t n) {
+	int ***table = &vm->pages[n / VM_TABLE_PAGES];
+	if (*table == NULL) {
+		*table = xmalloc(VM_TABLE_PAGES * sizeof(int *));
+		memset(*table, 0, VM_TABLE_PAGES * sizeof(int *));
+	}
+	int **page = &(*table)[n % VM_TABLE_PAGES];
+	if (*page == NULL) {
+		*page = xmalloc(VM_PAGE_CELLS * sizeof(int));
+		memset(*page, 0, VM_PAGE_CELLS * sizeof(int));
+	}
+	return *page;
+}
+
+/*
+ * The cells of page n of the memory, ncells of them (VM_PAGE_CELLS but
+ * in the last page), or NULL if they are all zero.
+ */
+const int *vm_cells(const struct vm *vm, const size_t n, size_t *ncells) {
+	const size_t first = n * VM_PAGE_CELLS;
+	*ncells = (vm->memsize - first < VM_PAGE_CELLS) ? vm->memsize - first : VM_PAGE_CELLS;
+
+	const int *cells;
+	if (vm->mem != NULL) {
+		cells = vm->mem + first;
+	} else {
+		int *const *table = vm->pages[n / VM_TABLE_PAGES];
+		cells = (table != NULL) ? table[n % VM_TABLE_PAGES] : NULL;
+	}
+	for (size_t i = 0; cells != NULL && i < *ncells; i++) {
+		if (cells[i] != 0) {
+			return cells;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Report a runtime error, then empty the stack printing its content
+ * from the top.
+ */
+void vm_error(struct vm *vm, int lineno, int *sp, const char *fmt, ...)
+{
+	va_list ap;
+
+	writer_flush(&vm->out);
+	fprintf(vm->err, "sem: ");
+	va_start(ap, fmt);
+	vfprintf(vm->err, fmt, ap);
+	va_end(ap);
+	fprintf(vm->err, "\n");
+	fprintf(vm->err, "line: %d\n", lineno);
+	fprintf(vm->err, "stack: \n");
+	while (sp != vm->stack) {
+		sp--;
+		fprintf(vm->err, " [%d] %d\n", (int)(sp - vm->stack), *sp);
+	}
+	vm->stacktop = vm->stack;
+}
+
+/*
+ * Read an integer into D[p]. Returns -1, after reporting the error, when
+ * p is not a valid address or the input is not an integer.
+ */
+int vm_read(struct vm *vm, int lineno, int *sp, const int p)
+{
+	if (p < 0 || (size_t)p >= vm->memsize) {
+		vm_error(vm, lineno, sp, "invalid memory address %d for read", p);
+		return -1;
+	}
+
+	struct reader *const in = &vm->in;
+	int q;
+	writer_flush(&vm->out);
+	switch (reader_int(in, &q)) {
+	case READ_OK:
+		vm_store(vm, (size_t)p, q);
+		return 0;
+	case READ_EOF:
+		vm_error(vm, lineno, sp, "EOF during read");
+		break;
+	case READ_RANGE:
+		vm_error(vm, lineno, sp, "invalid integer literal '%.*s'", (int)in->toklen, in->token);
+		break;
+	case READ_INVALID:
+		vm_error(vm, lineno, sp, "invalid '%c' in integer literal '%.*s' ", in->bad, (int)in->toklen, in->token);
+		break;
+	}
+	return -1;
+}
+
+/*
+ * Check that a stack of stacksize values holds what the deepest line of
+ * the code needs. Returns -1, after reporting the error, if it does not.
+ */
+int vm_check_stack(const struct code *code, const size_t stacksize)
+{
+	if (code->depth <= stacksize) {
+		return 0;
+	}
+	fprintf(stderr, "sem: line %d needs a stack of %zu values, more than %zu\n",
+		code->depth_line, code->depth, stacksize);
+	return -1;
+}
+
+/*
+ * Macros shared by all engines. Each engine keeps the instruction
+ * pointer (ip) and the stack top (sp) in locals, storing them back
+ * into the vm only when it stops. PC() is the index of the current
+ * opcode, from which errors find their line.
+ */
+#define LINENO()	code_lineno(code, PC())
+
+#define ERROR(...)					\
+    do {						\
+	vm_error(vm, LINENO(), sp, __VA_ARGS__);	\
+	ABORT();					\
+    } while(0)
+
+#define ABORT()					\
+    do {					\
+	sp = vm->stack;				\
+	sts = -1;				\
+	goto out;				\
+    } while(0)
+
+#define HALT_VM()				\
+    do {					\
+	sts = 1;				\
+	goto out;				\
+    } while(0)
+
+/*
+ * Stack manipulation macros. Neither checks: the stack was checked to
+ * hold the deepest line (see vm_check_stack()).
+ */
+#define POP()           (*--sp)
+#define PUSH(x)         (*sp++ = (x))
+
+/*
+ * Jump to line n when cond holds. The target is checked in any case,
+ * as it is computed before the condition.
+ */
+#define JUMP_IF(n, cond)				\
+    do {						\
+	if ((n) < 1 || (size_t)(n) >= code->size)	\
+	    ERROR("cannot jump to line %d", (n));	\
+	if (cond)					\
+	    JUMP_TO(code->jumps[(n) - 1]);		\
+	NEXT();						\
+    } while(0)
+
+/* Jump to the opcode in the argument of a branch when cond holds. */
+#define BRANCH_IF(cond)					\
+    do {						\
+	if (cond)					\
+	    JUMP_TO(ip->intv);				\
+	NEXT();						\
+    } while(0)
+
+/*
+ * Access to D[p], once p is checked: engines for a flat memory only
+ * redefine them as mem[p].
+ */
+#define LOAD_CELL(p)		(mem != NULL ? mem[p] : vm_load(vm, (size_t)(p)))
+#define STORE_CELL(p, v)	vm_store(vm, (size_t)(p), (v))
+
+/*
+ * The engines that show every opcode run, to the profiler or the
+ * debugger, run the opcodes of loops too.
+ */
+#define RUN_LOOP(k)		(-1)
+
+/*
+ * Engines' locals, as expected by vm_loop.h; the size of the memory is
+ * a constant in the specialised ones.
+ */
+#define ENGINE_LOCALS(size)				\
+	int p; /* first operand                */	\
+	int q; /* second operand               */	\
+	int sts = 0; /* status                 */	\
+	int *sp = vm->stacktop;				\
+	int *const mem = vm->mem; /* NULL if sparse */	\
+	const size_t memsize = (size)
+
 /*
  * This interpreter (or virtual machine) uses an operand stack to
  * supply parameters operations, and to receive results back from
@@ -74,243 +356,468 @@ void vm_destroy(struct vm *vm) {
  *                          | HALT                |
  *                          |                     |
  *                          +---------------------+
+ *
+ * eval_code() runs the whole program in a single call, without
+ * returning to the caller after every opcode; eval_code_one_step() is
+ * used by the debugger and eval_code_profile() by the profiler. All
+ * include vm_loop.h, so they share the opcodes' implementation and
+ * report the same errors.
  */
-int eval_code(struct vm *vm, struct code *code) {
-	vm->ip = code->head;
+#ifndef USE_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+#endif
 
-	for (;;) {
-		const int sts = eval_code_one_step(vm, code);
-		if (sts < 0) {
-			return sts;
-		}
+/*
+ * The switch engine, for any memory; see run(). If fuel is not NULL,
+ * it runs on fuel, as eval_code_fuel() says.
+ */
+static int run_switch(struct vm *vm, const struct code *code, int64_t *fuel)
+{
+	ENGINE_LOCALS(vm->memsize);
+	const struct instr *ip = code->instrs + vm->ip;
+
+#define TARGET(op)	case op:
+#define NEXT()		do { ip++; goto dispatch; } while(0)
+#define JUMP_TO(i)	do {							\
+	const struct instr *to = code->instrs + (i);				\
+	if (fuel != NULL && to <= ip && (*fuel -= ip - to + 1) < 0) {		\
+		ip = to;							\
+		sts = VM_YIELD;							\
+		goto out;							\
+	}									\
+	ip = to;								\
+	goto dispatch;								\
+    } while(0)
+#define PC()		((size_t)(ip - code->instrs))
+#undef RUN_LOOP
+#define RUN_LOOP(k)	loop_run(vm, code, (k), fuel)
+
+dispatch:
+	switch (ip->opcode) {
+#include "vm_loop.h"
+
+	default:
+		ERROR("unknown opcode (%d); top is %d", ip->opcode, *sp);
+	}
+
+#undef TARGET
+#undef NEXT
+#undef JUMP_TO
+#undef RUN_LOOP
+#define RUN_LOOP(k)	(-1)
 
-		if (sts == 1) {
-			return 0;
+out:
+	vm->ip = PC();
+	vm->stacktop = sp;
+	return sts;
+}
+
+#undef PC
+
+/*
+ * Record an access to a watched cell, for eval_code_until(), and
+ * return the value of the cell after it.
+ */
+static int watch_hit(struct breakpoints *bp, int line, int p, int before, int after, int written)
+{
+	bp->line = line;
+	bp->addr = p;
+	bp->before = before;
+	bp->after = after;
+	bp->written = written;
+	return after;
+}
+
+#if USE_COMPUTED_GOTO
+
+/*
+ * Direct-threaded code: every opcode is replaced by the address of its
+ * implementation, so dispatching is a single indirect jump. Only for a
+ * flat memory.
+ */
+struct tinstr {
+	const void *handler;
+	int intv;
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+#define ENGINE		run_threaded
+#define MEMSIZE		vm->memsize
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+
+/*
+ * The variants for a memory of a constant size: the default one, and
+ * powers of two up to the largest memory.
+ */
+#define ENGINE		run_threaded_64
+#define MEMSIZE		((size_t)64)
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+
+#define ENGINE		run_threaded_256
+#define MEMSIZE		((size_t)256)
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+
+#define ENGINE		run_threaded_1024
+#define MEMSIZE		((size_t)1024)
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+
+#define ENGINE		run_threaded_4096
+#define MEMSIZE		((size_t)4096)
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+
+#define ENGINE		run_threaded_65536
+#define MEMSIZE		((size_t)65536)
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+
+#define ENGINE		run_threaded_1048576
+#define MEMSIZE		((size_t)1048576)
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+
+#define ENGINE		run_threaded_2147483648
+#define MEMSIZE		((size_t)2147483648)
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+
+/* The variants stopping at breakpoints, and watched cells, for the debugger. */
+#define ENGINE		run_threaded_until
+#define MEMSIZE		vm->memsize
+#define BREAKS
+#include "vm_threaded.h"
+#undef ENGINE
+
+#define ENGINE		run_threaded_watch
+#define WATCH
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+#undef BREAKS
+#undef WATCH
+
+/* The variant running on fuel, for the scheduler. */
+#define ENGINE		run_threaded_fuel
+#define MEMSIZE		vm->memsize
+#define FUEL
+#include "vm_threaded.h"
+#undef ENGINE
+#undef MEMSIZE
+#undef FUEL
+
+#pragma GCC diagnostic pop
+
+#endif
+
+static int run(struct vm *vm, const struct code *code)
+{
+#if USE_COMPUTED_GOTO
+	if (vm->mem != NULL) {
+		switch (vm->memsize) {
+		case 64:
+			return run_threaded_64(vm, code);
+		case 256:
+			return run_threaded_256(vm, code);
+		case 1024:
+			return run_threaded_1024(vm, code);
+		case 4096:
+			return run_threaded_4096(vm, code);
+		case 65536:
+			return run_threaded_65536(vm, code);
+		case 1048576:
+			return run_threaded_1048576(vm, code);
+		case 2147483648:
+			return run_threaded_2147483648(vm, code);
+		default:
+			return run_threaded(vm, code);
 		}
 	}
+#endif
+	return run_switch(vm, code, NULL);
+}
+
+/* A timestamp for the profiler: the cycle counter, where available. */
+static uint64_t profile_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * The profiling engine: a switch, as in eval_code_one_step(), where
+ * every dispatch first updates the counts.
+ */
+static int run_profiled(struct vm *vm, const struct code *code, struct profile *prof)
+{
+	ENGINE_LOCALS(vm->memsize);
+	const struct instr *ip = code->instrs + vm->ip;
+	int prev = -1;
+	int line = 0;
+	uint64_t start = profile_clock();
+
+#define TARGET(op)	case op:
+#define NEXT()		do { ip++; goto dispatch; } while(0)
+#define JUMP_TO(i)	do { ip = code->instrs + (i); goto dispatch; } while(0)
+#define PC()		((size_t)(ip - code->instrs))
+
+dispatch:
+	prof->hits[PC()]++;
+	if (prev >= 0) {
+		prof->pairs[prev][ip->opcode]++;
+	}
+	prev = (int)ip->opcode;
+	if (prof->timed && prof->line_at[PC()] != 0) {
+		const uint64_t now = profile_clock();
+		prof->ticks[line] += now - start;
+		start = now;
+		line = prof->line_at[PC()];
+	}
+
+	switch (ip->opcode) {
+#include "vm_loop.h"
+
+	default:
+		ERROR("unknown opcode (%d); top is %d", ip->opcode, *sp);
+	}
+
+#undef TARGET
+#undef NEXT
+#undef JUMP_TO
+
+out:
+	if (prof->timed) {
+		prof->ticks[line] += profile_clock() - start;
+	}
+	for (size_t i = 0; i < code->ninstrs; i++) {
+		prof->opcodes[code->instrs[i].opcode] += prof->hits[i];
+	}
+	vm->ip = PC();
+	vm->stacktop = sp;
+	return sts;
+}
+
+#undef PC
+
+int eval_code_profile(struct vm *vm, struct code *code, struct profile *prof)
+{
+	if (vm_check_stack(code, vm->stacksize) < 0) {
+		return -1;
+	}
+	vm_unshare(vm);
+	vm->ip = 0;
+
+	const int sts = run_profiled(vm, code, prof);
+	writer_flush(&vm->out);
+	if (sts < 0) {
+		return sts;
+	}
+
+	return 0;
+}
+
+int eval_code(struct vm *vm, struct code *code) {
+	vm->ip = 0;
+	return eval_code_resume(vm, code);
+}
+
+/* Run the program on from vm->ip, as restored or forked. */
+int eval_code_resume(struct vm *vm, struct code *code) {
+	if (vm_check_stack(code, vm->stacksize) < 0) {
+		return -1;
+	}
+	vm_unshare(vm);
+
+	const int sts = run(vm, code);
+	writer_flush(&vm->out);
+	if (sts < 0) {
+		return sts;
+	}
+
+	return 0;
 }
 
 // returns 1 on halt
 // returns 0 on success
 // returns < 0 on error
 int eval_code_one_step(struct vm *vm, struct code *code) {
-	int p; /* first operand                */
-	int q; /* second operand               */
-	int sts; /* status                       */
+	if (vm_check_stack(code, vm->stacksize) < 0) {
+		return -1;
+	}
+	vm_unshare(vm);
+	ENGINE_LOCALS(vm->memsize);
+	const struct instr *ip = code->instrs + vm->ip;
 
-#define ERROR(...)				\
-    do {					\
-      fprintf(stderr, "sem: " __VA_ARGS__);	\
-      fprintf(stderr, "\n");			\
-      fprintf(stderr, "line: %d\n", vm->lineno);	\
-      fprintf(stderr, "stack: \n");		\
-      while (!EMPTY()) {			\
-      	fprintf(stderr, " [%d] %d\n", (int) LEVEL(), POP());	\
-      }						\
-      sts = -1;					\
-      goto halt;				\
-    } while(0)
+#define TARGET(op)	case op:
+#define NEXT()		do { ip++; goto out; } while(0)
+#define JUMP_TO(i)	do { ip = code->instrs + (i); goto out; } while(0)
+#define PC()		((size_t)(ip - code->instrs))
 
-	/* Stack manipulation macros. */
-#define TOP()           (*vm->stacktop)
-#define LEVEL()         (vm->stacktop - vm->stack)
-#define EMPTY()         (LEVEL() == 0)
-#define POP()           (*--vm->stacktop)
-#define PUSH(x)					\
-    do {					\
-	if (LEVEL() < vm->stacksize)		\
-	    *vm->stacktop++ = (x);		\
-	else					\
-	    ERROR("stack overflow");		\
-    } while(0)
+	/* Instruction execution. */
+	switch (ip->opcode) {
+#include "vm_loop.h"
 
-	/* Initialization. */
-	sts = 0;
+	default:
+		ERROR("unknown opcode (%d); top is %d", ip->opcode, *sp);
+	}
 
-	/* Instruction execution. */
-	switch (vm->ip->opcode) {
-		case INT:
-			PUSH(vm->ip->intv);
-			break;
-
-		case SET:
-			q = POP();
-			p = POP();
-
-			if (p < 0 || p >= vm->memsize) {
-				ERROR("invalid memory address %d for target", p);
-			}
-			vm->mem[p] = q;
-			break;
-
-		case MEM:
-			p = POP();
-
-			if (p < 0 || p >= vm->memsize)
-				ERROR("invalid memory address %d", p);
-
-			PUSH(vm->mem[p]);
-			break;
-
-		case SETLINENO:
-			vm->lineno = vm->ip->intv;
-			break;
-
-		case JUMP:
-			q = POP();
-
-			if (q < 1 || q >= code->size) {
-				ERROR("cannot jump to line %d", q);
-			}
-
-			vm->ip = code->jumps[q - 1];
-			break;
-
-		case JUMPT:
-			p = POP();
-			q = POP();
-
-			if (q < 1 || q >= code->size) {
-				ERROR("cannot jump to line %d", q);
-			}
-
-			if (p != 0) {
-				vm->ip = code->jumps[q - 1];
-			}
-			break;
-
-		case HALT:
-			sts = 1;
-			goto halt;
-
-		case IP:
-			PUSH(vm->lineno + 1);
-			break;
-
-		case WRITE_INT:
-			p = POP();
-			printf("%d", p);
-			break;
-
-		case WRITE_STR:
-			printf("%s", vm->ip->strv);
-			break;
-
-		case WRITELN_INT:
-			p = POP();
-			printf("%d\n", p);
-			break;
-
-		case WRITELN_STR:
-			printf("%s\n", vm->ip->strv);
-			break;
-
-		case READ: {
-			p = POP();
-
-			if (p < 0 || p >= vm->memsize) {
-				ERROR("invalid memory address %d for read", p);
-			}
-
-			char answer[1024];
-			char *ep;
-			if (ask("", answer, sizeof(answer)) < 0) {
-				ERROR("EOF during read");
-			}
-			errno = 0;
-			q = strtol(answer, &ep, 10);
-
-			if (errno == ERANGE) {
-				ERROR("invalid integer literal '%s'", answer);
-			}
-
-			if (*ep != 0) {
-				ERROR("invalid '%c' in integer literal '%s' ",
-				      *ep, answer);
-			}
-			vm->mem[p] = q;
-			break;
+#undef TARGET
+#undef NEXT
+#undef JUMP_TO
+
+out:
+	/* The debugger prints after every step. */
+	writer_flush(&vm->out);
+
+	/* Next instruction fetch. */
+	vm->ip = PC();
+	vm->stacktop = sp;
+	return sts;
+}
+
+#undef PC
+
+/*
+ * The cell the opcode at vm->ip is about to access, if it reads or
+ * writes one, setting *writes; otherwise -1, as when the stack does not
+ * hold what the opcode pops.
+ */
+int vm_access(const struct vm *vm, const struct code *code, int *writes)
+{
+	const struct instr *in = &code->instrs[vm->ip];
+	const int *sp = vm->stacktop;
+
+	*writes = in->opcode == SET || in->opcode == SETU || in->opcode == STORE || in->opcode == READ;
+	if (sp - vm->stack < opcode_pops[in->opcode]) {
+		return -1;
+	}
+	if (in->opcode == SET || in->opcode == SETU) {
+		return sp[-2];
+	}
+	if (in->opcode == READ || in->opcode == MEM || in->opcode == MEMU) {
+		return sp[-1];
+	}
+	if (in->opcode == STORE || in->opcode == LOAD) {
+		return in->intv;
+	}
+	return -1;
+}
+
+/*
+ * Where there is no threaded engine, or the steps are recorded,
+ * eval_code_until() takes a step at a time, looking for breakpoints and
+ * watched cells around each.
+ */
+static int step_until(struct vm *vm, struct code *code, struct breakpoints *bp)
+{
+	for (int first = 1;; first = 0) {
+		const int line = code_lineno(code, vm->ip);
+		if ((!first || bp->stopped != VM_BREAK)
+		    && code->jumps[line - 1] == vm->ip && has_breakpoint(bp, line)
+		    && (bp->stop == NULL || bp->stop(bp->arg, line))) {
+			return VM_BREAK;
 		}
 
-		case ADD: /* p + q */
-			q = POP();
-			p = POP();
-			PUSH(p + q);
-			break;
-
-		case SUB: /* p - q */
-			q = POP();
-			p = POP();
-			PUSH(p - q);
-			break;
-
-		case MUL: /* p * q */
-			q = POP();
-			p = POP();
-			PUSH(p * q);
-			break;
-
-		case DIV: /* p / q */
-			q = POP();
-			p = POP();
-			if (q == 0) {
-				ERROR("division by zero");
-			}
-			PUSH(p / q);
-			break;
-
-		case MOD: /* p % q */
-			q = POP();
-			p = POP();
-			if (q == 0) {
-				ERROR("division by zero");
-			}
-			PUSH(p % q);
-			break;
-
-		case EQ: /* p = q */
-			q = POP();
-			p = POP();
-			PUSH(p == q);
-			break;
-
-		case NE: /* p != q */
-			q = POP();
-			p = POP();
-			PUSH(p != q);
-			break;
-
-		case GT: /* p > q */
-			q = POP();
-			p = POP();
-			PUSH(p > q);
-			break;
-
-		case LT: /* p < q */
-			q = POP();
-			p = POP();
-			PUSH(p < q);
-			break;
-
-		case GE: /* p >= q */
-			q = POP();
-			p = POP();
-			PUSH(p >= q);
-			break;
-
-		case LE: /* p <= q */
-			q = POP();
-			p = POP();
-			PUSH(p <= q);
-			break;
+		int writes;
+		const int p = vm_access(vm, code, &writes);
+		const int watched = bp->watch_limit > 0 && is_watched(writes ? bp->writes : bp->reads, bp, p);
+		const int before = watched ? vm_load(vm, (size_t)p) : 0;
 
-		default:
-			ERROR("unknown opcode (%d); top is %d", vm->ip->opcode, TOP());
+		const int sts = (bp->history != NULL) ? history_forward(bp->history, vm, code) : eval_code_one_step(vm, code);
+		if (sts != 0) {
+			return sts;
+		}
+		if (watched) {
+			watch_hit(bp, line, p, before, vm_load(vm, (size_t)p), writes);
+			return VM_WATCH;
+		}
 	}
+}
 
-halt:
-	/* Next instruction fetch. */
-	vm->ip = vm->ip->next;
+/*
+ * Run from vm->ip until the program ends, reaches a line with a
+ * breakpoint where bp->stop agrees to stop, or accesses a watched cell.
+ * Then it returns VM_BREAK, with vm->ip at the first opcode of the line,
+ * or VM_WATCH, with vm->ip after the opcode accessing the cell and the
+ * access in bp; otherwise it returns as eval_code_one_step(). Right
+ * after a breakpoint, it does not stop there again at once. Without
+ * breakpoints (bp is NULL) it runs on the switch engine, which costs
+ * nothing to start, as for the conditions of the breakpoints.
+ */
+int eval_code_until(struct vm *vm, struct code *code, struct breakpoints *bp)
+{
+	if (vm_check_stack(code, vm->stacksize) < 0) {
+		return -1;
+	}
+	vm_unshare(vm);
+
+	int sts;
+	if (bp == NULL) {
+		sts = run_switch(vm, code, NULL);
+	} else if (bp->history != NULL) {
+		sts = step_until(vm, code, bp);
+#if USE_COMPUTED_GOTO
+	} else if (vm->mem != NULL && bp->watch_limit > 0) {
+		sts = run_threaded_watch(vm, code, bp);
+	} else if (vm->mem != NULL) {
+		sts = run_threaded_until(vm, code, bp);
+#endif
+	} else {
+		sts = step_until(vm, code, bp);
+	}
+	writer_flush(&vm->out);
+	if (bp != NULL) {
+		bp->stopped = sts;
+	}
+	return sts;
+}
 
+/*
+ * Run from vm->ip on fuel: a backward jump costs the opcodes it jumps
+ * back over, and once *fuel is spent the engine stops at its target,
+ * returning VM_YIELD, for the program to go on later from there. Every
+ * loop jumps back, so this bounds what runs between two checks by the
+ * size of the code, and costs a compare on jumps only. *fuel is left
+ * with what remains, below 0 if it was overspent. Returns as
+ * eval_code_one_step() otherwise. The output is flushed only once the
+ * program ends.
+ */
+int eval_code_fuel(struct vm *vm, struct code *code, int64_t *fuel)
+{
+	if (vm_check_stack(code, vm->stacksize) < 0) {
+		return -1;
+	}
+	vm_unshare(vm);
+
+#if USE_COMPUTED_GOTO
+	const int sts = (vm->mem != NULL) ? run_threaded_fuel(vm, code, fuel) : run_switch(vm, code, fuel);
+#else
+	const int sts = run_switch(vm, code, fuel);
+#endif
+	if (sts != VM_YIELD) {
+		writer_flush(&vm->out);
+	}
 	return sts;
 }
@@ -0,0 +1,314 @@
+/*
+ * vm_loop.h -- The opcodes
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * This is not a header: it is the body of the interpreter, included by
+ * vm.c once for every engine. The including function provides:
+ *
+ *   TARGET(op)     start of the implementation of op
+ *   NEXT()         fetch and dispatch the next opcode
+ *   JUMP_TO(i)     continue at code->instrs[i]
+ *   ERROR(...)     report a runtime error and stop
+ *   LINENO()       the line of the current opcode
+ *   ABORT()        stop after an error already reported
+ *   HALT_VM()      stop the program
+ *   JUMP_IF(n, c)  jump to line n if c holds, otherwise continue
+ *   BRANCH_IF(c)   jump to the opcode ip->intv if c holds
+ *
+ *   LOAD_CELL(p)   D[p], once p is checked
+ *   STORE_CELL(p, v)  set D[p] to v, once p is checked
+ *   RUN_LOOP(k)    run the loop k at once, as loop_run(), or -1
+ *
+ * and the locals ip, sp, mem, memsize, p, q and sts.
+ */
+
+TARGET(INT)
+	PUSH(ip->intv);
+	NEXT();
+
+TARGET(SET)
+	q = POP();
+	p = POP();
+
+	if (p < 0 || (size_t)p >= memsize) {
+		ERROR("invalid memory address %d for target", p);
+	}
+	STORE_CELL(p, q);
+	NEXT();
+
+TARGET(MEM)
+	p = POP();
+
+	if (p < 0 || (size_t)p >= memsize) {
+		ERROR("invalid memory address %d", p);
+	}
+	PUSH(LOAD_CELL(p));
+	NEXT();
+
+TARGET(SETLINENO) /* never run: the compiler removes it */
+	NEXT();
+
+TARGET(JUMP)
+	q = POP();
+
+	if (q < 1 || (size_t)q >= code->size) {
+		ERROR("cannot jump to line %d", q);
+	}
+	JUMP_TO(code->jumps[q - 1]);
+
+TARGET(JUMPT)
+	p = POP();
+	q = POP();
+	JUMP_IF(q, p != 0);
+
+TARGET(HALT)
+	HALT_VM();
+
+TARGET(IP) /* the next line, resolved by the compiler */
+	PUSH(ip->intv);
+	NEXT();
+
+TARGET(WRITE_INT)
+	p = POP();
+	writer_int(&vm->out, p);
+	NEXT();
+
+TARGET(WRITE_STR)
+	writer_str(&vm->out, code->strings + ip->intv, code_strlen(code->strings + ip->intv));
+	NEXT();
+
+TARGET(WRITELN_INT)
+	p = POP();
+	writer_int(&vm->out, p);
+	writer_char(&vm->out, '\n');
+	NEXT();
+
+TARGET(WRITELN_STR)
+	writer_str(&vm->out, code->strings + ip->intv, code_strlen(code->strings + ip->intv));
+	writer_char(&vm->out, '\n');
+	NEXT();
+
+TARGET(READ)
+	p = POP();
+
+	if (vm_read(vm, LINENO(), sp, p) < 0) {
+		ABORT();
+	}
+	NEXT();
+
+TARGET(ADD) /* p + q */
+	q = POP();
+	p = POP();
+	PUSH(p + q);
+	NEXT();
+
+TARGET(SUB) /* p - q */
+	q = POP();
+	p = POP();
+	PUSH(p - q);
+	NEXT();
+
+TARGET(MUL) /* p * q */
+	q = POP();
+	p = POP();
+	PUSH(p * q);
+	NEXT();
+
+TARGET(DIV) /* p / q */
+	q = POP();
+	p = POP();
+	if (q == 0) {
+		ERROR("division by zero");
+	}
+	PUSH(p / q);
+	NEXT();
+
+TARGET(MOD) /* p % q */
+	q = POP();
+	p = POP();
+	if (q == 0) {
+		ERROR("division by zero");
+	}
+	PUSH(p % q);
+	NEXT();
+
+TARGET(EQ) /* p = q */
+	q = POP();
+	p = POP();
+	PUSH(p == q);
+	NEXT();
+
+TARGET(NE) /* p != q */
+	q = POP();
+	p = POP();
+	PUSH(p != q);
+	NEXT();
+
+TARGET(GT) /* p > q */
+	q = POP();
+	p = POP();
+	PUSH(p > q);
+	NEXT();
+
+TARGET(LT) /* p < q */
+	q = POP();
+	p = POP();
+	PUSH(p < q);
+	NEXT();
+
+TARGET(GE) /* p >= q */
+	q = POP();
+	p = POP();
+	PUSH(p >= q);
+	NEXT();
+
+TARGET(LE) /* p <= q */
+	q = POP();
+	p = POP();
+	PUSH(p <= q);
+	NEXT();
+
+/* Superinstructions. */
+
+TARGET(LOAD) /* D[k] */
+	p = ip->intv;
+
+	if (p < 0 || (size_t)p >= memsize) {
+		ERROR("invalid memory address %d", p);
+	}
+	PUSH(LOAD_CELL(p));
+	NEXT();
+
+TARGET(STORE) /* set k, q */
+	q = POP();
+	p = ip->intv;
+
+	if (p < 0 || (size_t)p >= memsize) {
+		ERROR("invalid memory address %d for target", p);
+	}
+	STORE_CELL(p, q);
+	NEXT();
+
+TARGET(ADDI) /* p + k */
+	sp[-1] += ip->intv;
+	NEXT();
+
+TARGET(SUBI) /* p - k */
+	sp[-1] -= ip->intv;
+	NEXT();
+
+TARGET(MULI) /* p * k */
+	sp[-1] *= ip->intv;
+	NEXT();
+
+TARGET(DIVI) /* p / k, with k != 0 */
+	sp[-1] /= ip->intv;
+	NEXT();
+
+TARGET(MODI) /* p % k, with k != 0 */
+	sp[-1] %= ip->intv;
+	NEXT();
+
+TARGET(EQI) /* p = k */
+	sp[-1] = sp[-1] == ip->intv;
+	NEXT();
+
+TARGET(NEI) /* p != k */
+	sp[-1] = sp[-1] != ip->intv;
+	NEXT();
+
+TARGET(GTI) /* p > k */
+	sp[-1] = sp[-1] > ip->intv;
+	NEXT();
+
+TARGET(LTI) /* p < k */
+	sp[-1] = sp[-1] < ip->intv;
+	NEXT();
+
+TARGET(GEI) /* p >= k */
+	sp[-1] = sp[-1] >= ip->intv;
+	NEXT();
+
+TARGET(LEI) /* p <= k */
+	sp[-1] = sp[-1] <= ip->intv;
+	NEXT();
+
+TARGET(GOTO) /* jump k */
+	JUMP_TO(ip->intv);
+
+TARGET(JEQ) /* jumpt k, p = q */
+	q = POP();
+	p = POP();
+	BRANCH_IF(p == q);
+
+TARGET(JNE) /* jumpt k, p != q */
+	q = POP();
+	p = POP();
+	BRANCH_IF(p != q);
+
+TARGET(JGT) /* jumpt k, p > q */
+	q = POP();
+	p = POP();
+	BRANCH_IF(p > q);
+
+TARGET(JLT) /* jumpt k, p < q */
+	q = POP();
+	p = POP();
+	BRANCH_IF(p < q);
+
+TARGET(JGE) /* jumpt k, p >= q */
+	q = POP();
+	p = POP();
+	BRANCH_IF(p >= q);
+
+TARGET(JLE) /* jumpt k, p <= q */
+	q = POP();
+	p = POP();
+	BRANCH_IF(p <= q);
+
+/* Accesses proven in range. */
+
+TARGET(MEMU) /* D[p], with 0 <= p <= k */
+	p = POP();
+
+	if ((size_t)p >= memsize) {
+		ERROR("invalid memory address %d", p);
+	}
+	PUSH(LOAD_CELL(p));
+	NEXT();
+
+TARGET(SETU) /* set p, q, with 0 <= p <= k */
+	q = POP();
+	p = POP();
+
+	if ((size_t)p >= memsize) {
+		ERROR("invalid memory address %d for target", p);
+	}
+	STORE_CELL(p, q);
+	NEXT();
+
+/* Loops. */
+
+TARGET(LOOP) /* the loop k at once, or its opcodes after this one */
+	if ((p = RUN_LOOP(ip->intv)) >= 0) {
+		JUMP_TO(p);
+	}
+	NEXT();
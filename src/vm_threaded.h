@@ -0,0 +1,242 @@
+/*
+ * vm_threaded.h -- The threaded engine
+ *
+ * Copyright (C) 2003-2013 Davide Angelocola <davide.angelocola@gmail.com>
+ *
+ * Sem is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Sem is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * This is not a header: it is the direct-threaded engine, included by
+ * vm.c once for every memory size it is specialised for. The including
+ * file defines:
+ *
+ *   ENGINE         the name of the function
+ *   MEMSIZE        the size of the memory, a constant for a variant
+ *   BREAKS         if defined, the engine stops at breakpoints, as
+ *                  eval_code_until() does
+ *   WATCH          if defined too, at accesses to watched cells
+ *   FUEL           if defined, the engine runs on fuel, as
+ *                  eval_code_fuel() does
+ *
+ * With a constant power of two, checking an address is a mask of its
+ * bits, and with 2^31 cells only its sign. Loops are run at once (see
+ * loop_run()), except in the engines that stop at breakpoints.
+ * Besides, the accesses that are proven in range for this memory get
+ * handlers without the check when the code is threaded.
+ */
+
+#ifdef BREAKS
+static int ENGINE(struct vm *vm, const struct code *code, struct breakpoints *bp)
+#elif defined(FUEL)
+static int ENGINE(struct vm *vm, const struct code *code, int64_t *fuel)
+#else
+static int ENGINE(struct vm *vm, const struct code *code)
+#endif
+{
+	static const void *const handlers[] = {
+#define X(op, pops, pushes) [op] = &&L_##op,
+		OPCODES(X)
+#undef X
+	};
+	ENGINE_LOCALS(MEMSIZE);
+
+	/* The code is threaded once, and kept in the vm for the next runs. */
+	if (vm->thread_code != code->id || vm->thread_engine != handlers) {
+		struct tinstr *const t = xrealloc(vm->thread, code->ninstrs * sizeof(struct tinstr));
+		for (size_t i = 0; i < code->ninstrs; i++) {
+			const struct instr *in = &code->instrs[i];
+#ifdef WATCH
+			/* Every access goes through LOAD_CELL() and STORE_CELL(), which watch. */
+			const int in_memory = 0;
+			if (in->opcode == READ) {
+				t[i].handler = &&L_READ_W;
+				t[i].intv = in->intv;
+				continue;
+			}
+#else
+			const int in_memory = in->intv >= 0 && (size_t)in->intv < memsize;
+#endif
+			t[i].handler = handlers[in->opcode];
+			t[i].intv = in->intv;
+			if (in->opcode == LOAD && in_memory) {
+				t[i].handler = &&L_LOAD_IN;
+			} else if (in->opcode == STORE && in_memory) {
+				t[i].handler = &&L_STORE_IN;
+			} else if (in->opcode == MEMU && in_memory) {
+				t[i].handler = &&L_MEMU_IN;
+			} else if (in->opcode == SETU && in_memory) {
+				t[i].handler = &&L_SETU_IN;
+			}
+		}
+		vm->thread = t;
+		vm->thread_code = code->id;
+		vm->thread_engine = handlers;
+	}
+	struct tinstr *const thread = vm->thread;
+	const struct tinstr *ip = thread + vm->ip;
+#ifdef BREAKS
+	/*
+	 * The first opcode of a line with a breakpoint goes to L_BREAK,
+	 * which continues with the line's own handler, kept in resume[].
+	 * After a breakpoint, the engine starts with the handler of its
+	 * first opcode, so that it does not stop there again at once.
+	 * The thread is kept as it was threaded: out puts the handlers
+	 * back, and only the lines with breakpoints are visited.
+	 */
+	const void *start = ip->handler;
+	const void **resume = xmalloc(code->size * sizeof(void *));
+	const size_t nwords = code->size / 64 + 1;
+	for (size_t w = 0; w < nwords; w++) {
+		for (uint64_t bits = bp->lines[w]; bits != 0; bits &= bits - 1) {
+			const size_t n = w * 64 + (size_t)__builtin_ctzll(bits);
+			const size_t i = (n >= 1 && n < code->size) ? code->jumps[n - 1] : code->ninstrs;
+			if (i < code->ninstrs && thread[i].handler != &&L_BREAK) {
+				resume[code_lineno(code, i)] = thread[i].handler;
+				thread[i].handler = &&L_BREAK;
+			}
+		}
+	}
+	if (bp->stopped != VM_BREAK) {
+		start = ip->handler;
+	}
+#endif
+#ifdef WATCH
+	int hit = 0; /* set by an access to a watched cell */
+#endif
+
+#define TARGET(op)	L_##op:
+#ifdef WATCH
+#define NEXT()		do { ip++; if (hit) goto watched; goto *ip->handler; } while(0)
+#else
+#define NEXT()		do { ip++; goto *ip->handler; } while(0)
+#endif
+#ifdef FUEL
+#define JUMP_TO(i)	do {							\
+	const struct tinstr *to = thread + (i);					\
+	if (to <= ip && (*fuel -= ip - to + 1) < 0) {				\
+		ip = to;							\
+		sts = VM_YIELD;							\
+		goto out;							\
+	}									\
+	ip = to;								\
+	goto *ip->handler;							\
+    } while(0)
+#else
+#define JUMP_TO(i)	do { ip = thread + (i); goto *ip->handler; } while(0)
+#endif
+#define PC()		((size_t)(ip - thread))
+#undef RUN_LOOP
+#if defined(BREAKS)
+#define RUN_LOOP(k)	(-1)
+#elif defined(FUEL)
+#define RUN_LOOP(k)	loop_run(vm, code, (k), fuel)
+#else
+#define RUN_LOOP(k)	loop_run(vm, code, (k), NULL)
+#endif
+#undef LOAD_CELL
+#undef STORE_CELL
+#ifdef WATCH
+#define LOAD_CELL(p)		(is_watched(bp->reads, bp, p) ? (hit = 1, watch_hit(bp, LINENO(), p, mem[p], mem[p], 0)) : mem[p])
+#define STORE_CELL(p, v)	(mem[p] = is_watched(bp->writes, bp, p) ? (hit = 1, watch_hit(bp, LINENO(), p, mem[p], (v), 1)) : (v))
+#else
+#define LOAD_CELL(p)		mem[p]
+#define STORE_CELL(p, v)	(mem[p] = (v))
+#endif
+
+#ifdef BREAKS
+	goto *start;
+#else
+	goto *ip->handler;
+#endif
+#include "vm_loop.h"
+
+L_LOAD_IN:
+	PUSH(mem[ip->intv]);
+	NEXT();
+
+L_STORE_IN:
+	mem[ip->intv] = POP();
+	NEXT();
+
+L_MEMU_IN:
+	sp[-1] = mem[sp[-1]];
+	NEXT();
+
+L_SETU_IN:
+	q = POP();
+	p = POP();
+	mem[p] = q;
+	NEXT();
+
+#ifdef BREAKS
+L_BREAK:
+	p = code_lineno(code, PC());
+	vm->stacktop = sp;
+	if (bp->stop == NULL || bp->stop(bp->arg, p)) {
+		sts = VM_BREAK;
+		goto out;
+	}
+	goto *resume[p];
+#endif
+
+#ifdef WATCH
+L_READ_W:
+	p = POP();
+	q = (p >= 0 && (size_t)p < memsize) ? mem[p] : 0;
+	if (vm_read(vm, LINENO(), sp, p) < 0) {
+		ABORT();
+	}
+	if (is_watched(bp->writes, bp, p)) {
+		hit = 1;
+		watch_hit(bp, LINENO(), p, q, mem[p], 1);
+	}
+	NEXT();
+
+watched:
+	sts = VM_WATCH;
+	goto out;
+#endif
+
+#undef TARGET
+#undef NEXT
+#undef JUMP_TO
+#undef RUN_LOOP
+#undef LOAD_CELL
+#undef STORE_CELL
+#define RUN_LOOP(k)		(-1)
+#define LOAD_CELL(p)		(mem != NULL ? mem[p] : vm_load(vm, (size_t)(p)))
+#define STORE_CELL(p, v)	vm_store(vm, (size_t)(p), (v))
+
+out:
+	vm->ip = PC();
+	vm->stacktop = sp;
+#ifdef BREAKS
+	for (size_t w = 0; w < nwords; w++) {
+		for (uint64_t bits = bp->lines[w]; bits != 0; bits &= bits - 1) {
+			const size_t n = w * 64 + (size_t)__builtin_ctzll(bits);
+			const size_t i = (n >= 1 && n < code->size) ? code->jumps[n - 1] : code->ninstrs;
+			if (i < code->ninstrs && thread[i].handler == &&L_BREAK) {
+				thread[i].handler = resume[code_lineno(code, i)];
+			}
+		}
+	}
+	free(resume);
+#endif
+	return sts;
+}
+
+#undef PC
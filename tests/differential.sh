@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Differential test of an engine against the interpreter: every
+# example, run with the engine, must print what the interpreter prints,
+# and exit with the same status, for the same input. The engine is:
+#
+#   -a    compiled to an executable with the C compiler
+#   -j    run as native code (where there is no JIT, -j interprets,
+#         and the test passes trivially)
+#
+# usage: differential.sh sem examples-dir -a|-j
+#
+# The inputs are chosen so that every example halts.
+#
+
+sem=$1
+dir=$2
+engine=$3
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+status=0
+
+for f in "$dir"/*.sem; do
+	for opts in "" "-O" "-m 8" "-S"; do
+		if [ "$engine" = "-a" ] && ! "$sem" $opts -a -o "$tmp/prog" "$f"; then
+			echo "FAIL: $f ($opts -a): cannot compile"
+			status=1
+			continue
+		fi
+		for input in "5 3" "12 4" "10" "-1" "abc" "7 x" ""; do
+			printf '%s\n' "$input" | "$sem" $opts "$f" >"$tmp/expected" 2>&1
+			echo "exit $?" >>"$tmp/expected"
+			if [ "$engine" = "-a" ]; then
+				printf '%s\n' "$input" | "$tmp/prog" >"$tmp/actual" 2>&1
+			else
+				printf '%s\n' "$input" | "$sem" $opts $engine "$f" >"$tmp/actual" 2>&1
+			fi
+			echo "exit $?" >>"$tmp/actual"
+			if ! cmp -s "$tmp/expected" "$tmp/actual"; then
+				echo "FAIL: $f ($opts $engine) with input '$input'"
+				diff "$tmp/expected" "$tmp/actual"
+				status=1
+			fi
+		done
+	done
+done
+
+[ $status -eq 0 ] && echo "OK"
+exit $status
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "sem.h"
+
+static void assert_true(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "failed: %s\n", what);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void test_arena_alloc(void)
+{
+	struct arena a;
+	arena_init(&a);
+	char *p = arena_alloc(&a, 1);
+	char *q = arena_alloc(&a, 1);
+	assert_true((uintptr_t)p % alignof(max_align_t) == 0, "first allocation aligned");
+	assert_true((uintptr_t)q % alignof(max_align_t) == 0, "second allocation aligned");
+	assert_true(p != q, "distinct allocations");
+	assert_true(a.chunks != nullptr && a.chunks->next == nullptr, "one chunk for small allocations");
+	arena_destroy(&a);
+	assert_true(a.chunks == nullptr, "no chunks after destroy");
+}
+
+static void test_arena_large(void)
+{
+	struct arena a;
+	arena_init(&a);
+	const size_t size = 10 * 1024 * 1024;
+	unsigned char *p = arena_alloc(&a, size);
+	memset(p, 0xab, size);
+	assert_true(a.chunks->size >= size, "a chunk as large as the allocation");
+	arena_destroy(&a);
+}
+
+static void test_arena_many(void)
+{
+	struct arena a;
+	arena_init(&a);
+	int *last = nullptr;
+	for (int i = 0; i < 100000; i++) {
+		int *p = arena_alloc(&a, sizeof(int));
+		*p = i;
+		if (last != nullptr) {
+			assert_true(*last == i - 1, "earlier allocations untouched");
+		}
+		last = p;
+	}
+	size_t nchunks = 0;
+	for (struct arena_chunk *c = a.chunks; c != nullptr; c = c->next) {
+		nchunks++;
+	}
+	assert_true(nchunks < 16, "chunks grow geometrically");
+	arena_destroy(&a);
+}
+
+static void test_arena_strdup(void)
+{
+	struct arena a;
+	arena_init(&a);
+	const char *s = arena_strdup(&a, "hello");
+	assert_true(strcmp(s, "hello") == 0, "arena_strdup copies");
+	assert_true(strcmp(arena_strdup(&a, ""), "") == 0, "arena_strdup of an empty string");
+	arena_destroy(&a);
+}
+
+static void test_fnv1a(void)
+{
+	assert_true(fnv1a(FNV1A_SEED, "", 0) == FNV1A_SEED, "empty input");
+	assert_true(fnv1a(FNV1A_SEED, "a", 1) == UINT64_C(0xaf63dc4c8601ec8c), "known value");
+	assert_true(fnv1a(fnv1a(FNV1A_SEED, "fo", 2), "o", 1) == fnv1a(FNV1A_SEED, "foo", 3), "incremental");
+}
+
+int main(void)
+{
+	test_arena_alloc();
+	test_arena_large();
+	test_arena_many();
+	test_arena_strdup();
+	test_fnv1a();
+	return 0;
+}
@@ -0,0 +1,140 @@
+#!/bin/sh
+#
+# Test of the debugger: a session is fed to sem -d, and what it prints
+# must be what is expected. Built with -fsanitize=address, it also
+# catches the debugger or the engines touching memory they do not own.
+#
+# usage: test_debugger.sh sem
+#
+
+sem=$1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+status=0
+
+# session name: feeds $tmp/commands to $tmp/prog.sem, expecting
+# $tmp/expected, then what went to stderr
+session() {
+	"$sem" -d "$tmp/prog.sem" <"$tmp/commands" 2>"$tmp/errors" | tail -n +3 >"$tmp/actual"
+	echo >>"$tmp/actual"
+	cat "$tmp/errors" >>"$tmp/actual"
+	if ! cmp -s "$tmp/expected" "$tmp/actual"; then
+		echo "FAIL: $1"
+		diff "$tmp/expected" "$tmp/actual"
+		status=1
+	fi
+}
+
+cat >"$tmp/prog.sem" <<'SEM'
+set 1, D[0] + D[0] * D[0]
+set 2, 3
+set 0, D[0] + 1
+jumpt 1, D[0] < 5
+set writeln, D[1]
+halt
+SEM
+
+# A condition deeper than the line it stops at, tested after next has
+# left the program partway through a line.
+cat >"$tmp/commands" <<'CMD'
+break 3 if D[0] + D[1] * D[2] + D[0] * D[1] * D[2] > 100
+run
+next
+next
+continue
+memory
+continue
+continue
+quit
+CMD
+cat >"$tmp/expected" <<'OUT'
+sem> Breakpoint at line 3.
+sem> Started.
+sem> 24 LOAD (int=0,str=(null))
+sem> 24 LOAD (int=0,str=(null))
+sem> Breakpoint, line 3.
+3 set 0, D[0] + 1
+sem>    3   12    3    0    0    0    0    0    0    0           0 -   10
+   0    0    0    0    0    0    0    0    0    0          11 -   21
+   0    0    0    0    0    0    0    0    0    0          22 -   32
+   0    0    0    0    0    0    0    0    0    0          33 -   43
+   0    0    0    0    0    0    0    0    0    0          44 -   54
+   0    0    0    0    0    0    0    0    0               55 -   64
+sem> Breakpoint, line 3.
+3 set 0, D[0] + 1
+sem> 20
+Program ended.
+sem> 
+OUT
+session "conditional breakpoint after next"
+
+cat >"$tmp/prog.sem" <<'SEM'
+set 0, 0
+set 0, D[0] + 1
+jumpt 2, D[0] < ip
+set writeln, D[0]
+halt
+SEM
+
+# ip in a condition is what it is at the line of the breakpoint.
+cat >"$tmp/commands" <<'CMD'
+break 2 if D[0] + ip = 5
+run
+continue
+memory
+continue
+quit
+CMD
+cat >"$tmp/expected" <<'OUT'
+sem> Breakpoint at line 2.
+sem> Started.
+sem> Breakpoint, line 2.
+2 set 0, D[0] + 1
+sem>    2    0    0    0    0    0    0    0    0    0           0 -   10
+   0    0    0    0    0    0    0    0    0    0          11 -   21
+   0    0    0    0    0    0    0    0    0    0          22 -   32
+   0    0    0    0    0    0    0    0    0    0          33 -   43
+   0    0    0    0    0    0    0    0    0    0          44 -   54
+   0    0    0    0    0    0    0    0    0               55 -   64
+sem> 4
+Program ended.
+sem> 
+OUT
+session "ip in a condition"
+
+cat >"$tmp/prog.sem" <<'SEM'
+set 1, read
+set writeln, D[1]
+halt
+SEM
+
+# Recording after the program aborted: there is no history to go back
+# in, and the program stays aborted.
+cat >"$tmp/commands" <<'CMD'
+run
+continue
+xx
+record 500
+reverse-continue
+reverse-next
+goto 0
+next
+quit
+CMD
+cat >"$tmp/expected" <<'OUT'
+sem> Started.
+sem> Program aborted.
+sem> Recording the last 500 steps, in at most 18 KiB.
+sem> No more history.
+sem> No more history.
+sem> No more history.
+sem> Not in debug.
+sem> 
+sem: invalid 'x' in integer literal 'xx' 
+line: 1
+stack: 
+OUT
+session "no history after an abort"
+
+[ $status -eq 0 ] && echo "OK"
+exit $status
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "sem.h"
+
+static void assert_true(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "failed: %s\n", what);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Compile a program written to a temporary file. */
+static struct code *compile_string(const char *source)
+{
+	char filename[] = "/tmp/test_intern_XXXXXX";
+	const int fd = mkstemp(filename);
+	assert_true(fd >= 0, "temporary file");
+	FILE *fp = fdopen(fd, "w");
+	fputs(source, fp);
+	fclose(fp);
+	struct code *code = compile_code(filename, 0);
+	remove(filename);
+	assert_true(code != nullptr, "compiles");
+	return code;
+}
+
+/* The offsets of the string arguments, in order. */
+static size_t strings_of(const struct code *code, int *offsets, size_t n)
+{
+	size_t k = 0;
+	for (size_t i = 0; i < code->ninstrs && k < n; i++) {
+		if (code->instrs[i].opcode == WRITE_STR || code->instrs[i].opcode == WRITELN_STR) {
+			offsets[k++] = code->instrs[i].intv;
+		}
+	}
+	return k;
+}
+
+static void test_intern_shared(void)
+{
+	struct code *code = compile_string(
+		"set write, \"hello\"\n"
+		"set writeln, \"world\"\n"
+		"set writeln, \"hello\"\n"
+		"set write, \"hello\"\n"
+		"halt\n");
+	int s[4];
+	assert_true(strings_of(code, s, 4) == 4, "four strings");
+	assert_true(s[0] == s[2] && s[0] == s[3], "equal strings share storage");
+	assert_true(s[0] != s[1], "different strings do not");
+	assert_true(strcmp(code->strings + s[0], "hello") == 0, "hello");
+	assert_true(strcmp(code->strings + s[1], "world") == 0, "world");
+	assert_true(code_strlen(code->strings + s[1]) == 5, "length");
+	code_destroy(code);
+}
+
+static void test_intern_prefix(void)
+{
+	struct code *code = compile_string(
+		"set write, \"ab\"\n"
+		"set write, \"abc\"\n"
+		"set write, \"\"\n"
+		"set write, \"ab\"\n"
+		"halt\n");
+	int s[4];
+	assert_true(strings_of(code, s, 4) == 4, "four strings");
+	assert_true(s[0] != s[1] && s[0] != s[2] && s[1] != s[2], "a prefix is another string");
+	assert_true(s[0] == s[3], "ab is interned");
+	assert_true(code_strlen(code->strings + s[2]) == 0, "empty string");
+	code_destroy(code);
+}
+
+static void test_intern_many(void)
+{
+	/* Enough strings to grow the table a few times. */
+	char *source = xmalloc(1000 * 32 + 16);
+	char *p = source;
+	for (int i = 0; i < 1000; i++) {
+		p += sprintf(p, "set write, \"s%d\"\n", i % 500);
+	}
+	strcpy(p, "halt\n");
+	struct code *code = compile_string(source);
+	free(source);
+
+	int s[1000];
+	assert_true(strings_of(code, s, 1000) == 1000, "1000 strings");
+	for (int i = 0; i < 500; i++) {
+		char expect[16];
+		snprintf(expect, sizeof(expect), "s%d", i);
+		assert_true(s[i] == s[i + 500], "repeated strings share storage");
+		assert_true(strcmp(code->strings + s[i], expect) == 0, "contents");
+	}
+	assert_true(code->ninterned == 500, "500 distinct strings");
+	code_destroy(code);
+}
+
+int main(void)
+{
+	test_intern_shared();
+	test_intern_prefix();
+	test_intern_many();
+	return 0;
+}
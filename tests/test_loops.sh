@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Differential test of the loops run at once (see src/loops.c): every
+# program in the directory, fills, copies, sums and searches, in range
+# or not, overlapping or writing their own counters and bounds, must
+# print what the profiler prints, which runs the opcodes of the loops,
+# and exit with the same status, with every engine and memory size.
+# On fuel, the sparse memory, where loops are never run at once, is
+# the reference.
+#
+# usage: test_loops.sh sem loops-dir
+#
+
+sem=$1
+dir=$2
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+status=0
+
+# run opts file: what sem prints, its status, then its errors, but the profile
+run() {
+	"$sem" $1 "$f" >"$2" 2>"$tmp/err"
+	echo "exit $?" >>"$2"
+	sed '/^profile of /,$d' "$tmp/err" | sed '$ { /^$/d; }' >>"$2"
+}
+
+# check name expected-opts actual-opts
+check() {
+	run "$2" "$tmp/expected"
+	run "$3" "$tmp/actual"
+	if ! cmp -s "$tmp/expected" "$tmp/actual"; then
+		echo "FAIL: $1 ($3)"
+		diff "$tmp/expected" "$tmp/actual"
+		status=1
+	fi
+}
+
+for f in "$dir"/*.sem; do
+	for m in "-m 64" "-m 4096" "-m 5000"; do
+		for opts in "" "-O" "-j" "-O -j"; do
+			check "$f" "$m -p" "$m $opts"
+		done
+		for fuel in 1 10 333 5000 100000; do
+			check "$f" "$m -S -f $fuel" "$m -f $fuel"
+		done
+	done
+done
+
+[ $status -eq 0 ] && echo "OK"
+exit $status